@@ -11,17 +11,51 @@
 
 #include "avr/io.h"
 
-// Next page after reloader
+// Set to 1 to accept bootloader packed by CODEC_LZ, or 0 to accept only raw data
+#define CAN_UNPACK 1
+
+// Next page after reloader. 0x0340 leaves room for the unpacker, the build must end below it
+// (the host refuses a reloader that overlaps INFO). software/TinyLoaderCmd/reloader.hex is
+// still the build without descriptor, so until it is rebuilt from these sources the host
+// uses the old raw layout at 0x0280.
+#if CAN_UNPACK
+#define INFO_ADDRESS 0x0340
+#else
 #define INFO_ADDRESS 0x0280
+#endif
 
 // New bootloader address
 #define INFO_OFFSET INFO_ADDRESS
-// New bootloader crc16
+// New bootloader crc16, of the data as stored (packed or not)
 #define INFO_CRC ( INFO_ADDRESS + 2 )
+// New bootloader size after unpacking, must be FLASHEND + 1 - address
+#define INFO_SIZE ( INFO_ADDRESS + 4 )
+// Stored (packed) data size
+#define INFO_PACKED_SIZE ( INFO_ADDRESS + 6 )
+// Codec of stored data, see CODEC_*
+#define INFO_CODEC ( INFO_ADDRESS + 8 )
 // New bootloader data
 #define BOOTLOADER_DATA ( INFO_ADDRESS + SPM_PAGESIZE )
 
+// Raw data. Old hosts leave INFO_CODEC erased.
+#define CODEC_RAW 0xff
+// Byte oriented LZ77. Token below 0x80 is followed by ( token + 1 ) literal bytes.
+// Token 0x80 and above copies ( token - 0x80 + LZ_MIN_MATCH ) bytes, starting
+// at 16 bit distance back in unpacked data, which follows the token.
+#define CODEC_LZ 0x01
+#define LZ_MIN_MATCH 3
+
+// Supported codecs mask, bit number is codec id
+#if CAN_UNPACK
+#define CODECS _BV( CODEC_LZ )
+#else
+#define CODECS 0
+#endif
+
 // LED PIN. Comment if LED not present
 #define LED_PIN 4
+// Set to 1 to blink LED for 3 seconds before writing new bootloader, or 0 to start at once.
+// LED is lit while writing anyway.
+#define LED_START_BLINK 0
 
 #endif /* CONFIG_H_ */
\ No newline at end of file
@@ -49,6 +49,53 @@ static void switchBack(uint8_t code)
       __result;                                 \
 }))
 
+// Reloader descriptor for host, placed at flash address 0x0002 (see .reloaderinfo section)
+const uint16_t reloaderInfo[] __attribute__(( section( ".reloaderinfo" ), used )) = { INFO_ADDRESS, CODECS };
+
+// Next page of new bootloader
+static uint8_t page[ SPM_PAGESIZE ];
+
+// Check, if flash page already contains the data
+static uint8_t pageEqual( uint16_t dst )
+{
+	for( uint8_t i = 0; i < SPM_PAGESIZE; i++ ) {
+		if( pgm_read_byte( dst + i ) != page[ i ] ) return 0;
+	}
+	return 1;
+}
+
+#if CAN_UNPACK
+// Unpacker state
+static uint16_t packed = BOOTLOADER_DATA;
+static uint8_t literal;
+static uint8_t match;
+static uint16_t distance;
+
+// Unpack next byte. pos - position in unpacked data, which is written at address
+static uint8_t nextByte( uint16_t address, uint16_t pos )
+{
+	if( literal == 0 && match == 0 ) {
+		uint8_t token = pgm_read_byte( packed++ );
+		if( token < 0x80 ) {
+			literal = token + 1;
+		} else {
+			match = token - 0x80 + LZ_MIN_MATCH;
+			distance = pgm_read_word( packed );
+			packed += 2;
+		}
+	}
+	if( literal ) {
+		literal--;
+		return pgm_read_byte( packed++ );
+	}
+	match--;
+	uint16_t from = pos - distance;
+	// Current page is in RAM, previous pages are already written
+	if( from >= pos - pos % SPM_PAGESIZE ) return page[ from % SPM_PAGESIZE ];
+	return pgm_read_byte( address + from );
+}
+#endif
+
 int main(void)
 {
 #ifdef LED_PIN
@@ -63,6 +110,7 @@ int main(void)
 
 	uint16_t address = pgm_read_word( INFO_OFFSET );
 	uint16_t size = FLASHEND - address + 1;
+	uint8_t codec = pgm_read_byte( INFO_CODEC );
 	
 	// Empty reset vector - skip first phases, no way back
 	if( pgm_read_word( 0 ) != 0xffff ) {
@@ -72,12 +120,24 @@ int main(void)
 		// Bootloader address must be aligned by page.
 		if( address % SPM_PAGESIZE != 0 ) switchBack( 0x05 );
 	
-		// Bootloader must fit into available memory.
-		if( size > ( FLASHEND - BOOTLOADER_DATA + 1 ) / 2 - SPM_PAGESIZE ) switchBack( 0x07 );
+		// Stored data size
+		uint16_t stored = size;
+#if CAN_UNPACK
+		if( codec == CODEC_LZ ) {
+			// Unpacked data must be exactly the bootloader
+			if( pgm_read_word( INFO_SIZE ) != size ) switchBack( 0x04 );
+			stored = pgm_read_word( INFO_PACKED_SIZE );
+		} else
+#endif
+		// Codec must be known
+		if( codec != CODEC_RAW ) switchBack( 0x04 );
+	
+		// Stored data must fit below application vectors page, which is erased first.
+		if( address < BOOTLOADER_DATA + SPM_PAGESIZE || stored > address - SPM_PAGESIZE - BOOTLOADER_DATA ) switchBack( 0x07 );
 	
 		uint16_t crc = 0xffff;
 	
-		uint16_t end = BOOTLOADER_DATA + size;
+		uint16_t end = BOOTLOADER_DATA + stored;
 		for( uint16_t addr = BOOTLOADER_DATA; addr < end; addr++ ) {
 			crc = _crc16_update( crc, pgm_read_byte( addr ) );
 		}
@@ -85,8 +145,8 @@ int main(void)
 		if( crc != pgm_read_word( INFO_CRC ) ) switchBack( 0x2 );
 	
 		uint16_t op = pgm_read_word( BOOTLOADER_DATA );
-		// First instruction must be rjmp to valid address
-		if( op < 0xc000 && op >= 0xc000 + ( size / 2 ) ) switchBack( 0x3 );
+		// First instruction must be rjmp to valid address. Packed data starts with token.
+		if( codec == CODEC_RAW && op < 0xc000 && op >= 0xc000 + ( size / 2 ) ) switchBack( 0x3 );
 	
 
 ///////////////////////////////////////////////////////////////////////////////
@@ -102,36 +162,50 @@ int main(void)
 //                     Phase 3: write new bootloader                         //
 ///////////////////////////////////////////////////////////////////////////////
 
-#ifdef LED_PIN
+#if defined( LED_PIN ) && LED_START_BLINK
 	PORTB |= _BV( LED_PIN );
 	_delay_ms( 2000 );
 	PORTB &= ~_BV( LED_PIN );
 	_delay_ms( 1000 );
 #endif
+#ifdef LED_PIN
+	PORTB |= _BV( LED_PIN );
+#endif
 
 	// Erase application vectors
 	boot_page_erase( address - SPM_PAGESIZE );
 
-	uint16_t src = BOOTLOADER_DATA;
+	uint16_t pos = 0;
 	uint16_t dst = address;
 	while( dst <= FLASHEND - SPM_PAGESIZE + 1 ) {
-		// First - erase page
-		boot_page_erase( dst );
-		boot_spm_busy_wait();
+		// Prepare page in RAM
+		for( uint8_t i = 0; i < SPM_PAGESIZE; i++, pos++ ) {
+#if CAN_UNPACK
+			if( codec == CODEC_LZ ) page[ i ] = nextByte( address, pos );
+			else
+#endif
+			page[ i ] = pgm_read_byte( BOOTLOADER_DATA + pos );
+		}
+		// Pages, which are the same in old and new bootloader, are left as is
+		if( !pageEqual( dst ) ) {
+			// First - erase page
+			boot_page_erase( dst );
+			boot_spm_busy_wait();
 		
-		// Next - fill page
-		uint16_t end = src + SPM_PAGESIZE;
-		while( src < end ) {
-			uint16_t word = pgm_read_word( src );
-			boot_page_fill( dst, word );
+			// Next - fill page. Filling the buffer does not need to wait.
+			for( uint8_t i = 0; i < SPM_PAGESIZE; i += 2 ) {
+				boot_page_fill( dst + i, page[ i ] | ( page[ i + 1 ] << 8 ) );
+			}
+			// Final - write page
+			boot_page_write( dst );
 			boot_spm_busy_wait();
-			src += 2;
-			dst += 2;
 		}
-		// Final - write page
-		boot_page_write( dst - SPM_PAGESIZE );
+		dst += SPM_PAGESIZE;
 	}
 	
+#ifdef LED_PIN
+	PORTB &= ~_BV( LED_PIN );
+#endif
 	uint16_t vect = address / 2;
     asm volatile ("ijmp" :: "z"( vect ));
 }
\ No newline at end of file
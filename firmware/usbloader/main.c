@@ -21,6 +21,7 @@ at least be connected to INT0 as well.
 #include <avr/eeprom.h>
 #include <avr/boot.h>
 #include <avr/pgmspace.h>   /* required by usbdrv.h */
+#include <avr/sleep.h>
 #include <util/crc16.h>
 
 #include "usbdrv.h"
@@ -71,9 +72,65 @@ static uint16_t vectors[2];
 #endif
 
 
-#if CAN_READ_FLASH
+#if CAN_READ_FLASH || CAN_REPORT_STATUS
 static uchar exchangeReport[70];
 #endif
+#if CAN_REPORT_STATUS
+static uchar statusRequested;
+#endif
+#if LOADER_TICKS
+volatile uint16_t loaderTicks;
+volatile uint16_t usbSetupTicks;
+#endif
+#if LOADER_IDLE_TIMEOUT || LOADER_HOST_TIMEOUT
+#define TIMER0_TICKS(ms) ( (uint16_t)( (uint32_t)(ms) * TIMER0_TICK_RATE / 1000 ) )
+
+volatile uint8_t usbHostSeen;
+// Timer0 overflows since connect or since last valid report
+static uint16_t idleTicks;
+#endif
+
+#if LOADER_TICKS
+static inline void loaderTick()
+{
+	if( TIFR & _BV(TOV0) ) {
+		TIFR = _BV(TOV0);
+		loaderTicks++;
+#if LOADER_IDLE_TIMEOUT || LOADER_HOST_TIMEOUT
+		idleTicks++;
+#endif
+	}
+}
+#endif
+
+#if LOADER_IDLE_TIMEOUT || LOADER_HOST_TIMEOUT
+static inline uint8_t loaderTimeout()
+{
+	// Never leave with command in progress, or to the empty application
+	if( cmd || !applicationPresent() ) return 0;
+#if LOADER_HOST_TIMEOUT
+	if( !usbHostSeen && idleTicks >= TIMER0_TICKS( LOADER_HOST_TIMEOUT ) ) return 1;
+#endif
+#if LOADER_IDLE_TIMEOUT
+	if( idleTicks >= TIMER0_TICKS( LOADER_IDLE_TIMEOUT ) ) return 1;
+#endif
+	return 0;
+}
+#endif
+
+#if CAN_REPORT_STATUS
+static void readStatus( uchar *ptr )
+{
+	ptr[ STATUS_SIGNATURE ] = STATUS_SIGNATURE_VALUE;
+	ptr[ STATUS_CAPS ] = STATUS_CAPS_VALUE;
+	*(uint16_t*)( ptr + STATUS_ADDRESS ) = currentAddress;
+	*(uint16_t*)( ptr + STATUS_SETUP_TICKS ) = usbSetupTicks;
+	*(uint16_t*)( ptr + STATUS_TICK_RATE ) = TIMER0_TICK_RATE;
+	*(uint16_t*)( ptr + STATUS_TICKS ) = loaderTicks;
+	*(uint16_t*)( ptr + STATUS_MAGIC ) = STATUS_MAGIC_VALUE;
+}
+#endif
+
 #if CAN_CHECK_DATA
 static crc_t crc;
 static crc_t sign;
@@ -240,6 +297,13 @@ uchar usbFunctionWrite( uchar *data, uchar len )
 			return 0xff;
 		}
 #endif		
+#if LOADER_IDLE_TIMEOUT || LOADER_HOST_TIMEOUT
+		idleTicks = 0;
+#endif
+#if CAN_REPORT_STATUS
+		// Report without command is a status request
+		if( !cmd ) statusRequested = 1;
+#endif
 		delay = 10;
 		return 1;
 	}
@@ -251,8 +315,10 @@ uchar usbFunctionWrite( uchar *data, uchar len )
 usbMsgLen_t usbFunctionSetup( uchar data[8] )
 {
 usbRequest_t *rq = (void *)data;
+#if CAN_READ_FLASH || CAN_REPORT_STATUS
 #if CAN_READ_FLASH
 uchar i;
+#endif
 #if CAN_CHECK_DATA
 crc_t crc = CRC_INITIAL;
 #endif
@@ -262,11 +328,25 @@ crc_t crc = CRC_INITIAL;
 			
 		//  
 		exchangeReport[0] = 0;
+#if LOADER_IDLE_TIMEOUT || LOADER_HOST_TIMEOUT
+		// Reading is activity too, don't leave in the middle of a long read
+		idleTicks = 0;
+#endif
 			
 		uchar * ptr = exchangeReport + REPORT_DATA;
-		//   
-		for( i = 0; i < SPM_PAGESIZE; i++ ) {
-			ptr[i] = pgm_read_byte( currentAddress++ );
+#if CAN_REPORT_STATUS
+		if( statusRequested ) {
+			statusRequested = 0;
+			readStatus( ptr );
+		} else
+#endif
+		{
+			//   
+#if CAN_READ_FLASH
+			for( i = 0; i < SPM_PAGESIZE; i++ ) {
+				ptr[i] = pgm_read_byte( currentAddress++ );
+			}
+#endif
 		}
 #if CAN_CHECK_DATA
 		// And calculate crc
@@ -323,33 +403,99 @@ static inline void leaveBootloader()
     asm volatile ("rjmp __vectors - 4");
 }
 
-static inline void initForUsbConnectivity() 
+#if CAN_SERIAL_NUMBER
+// USB string descriptor of serial number, filled by initSerialNumber()
+int usbDescriptorStringSerialNumber[ 1 + SERIAL_NUMBER_LEN ];
+
+static inline uchar hexDigit( uchar value )
+{
+	return value < 10 ? '0' + value : 'A' - 10 + value;
+}
+
+static inline void initSerialNumber()
+{
+	int *ptr = usbDescriptorStringSerialNumber;
+	uchar i;
+	*ptr++ = USB_STRING_DESCRIPTOR_HEADER( SERIAL_NUMBER_LEN );
+	for( i = 0; i < SERIAL_NUMBER_BYTES; i++ ) {
+		uchar value = boot_signature_byte_get( SERIAL_NUMBER_START + i );
+		*ptr++ = hexDigit( value >> 4 );
+		*ptr++ = hexDigit( value & 0x0f );
+	}
+}
+#endif
+
+#if LOADER_IDLE_SLEEP
+// Sleep until next USB interrupt. Wakes up also by keep-alive on D- every millisecond.
+static inline void sleepIdle()
+{
+	cli();
+	// Do not sleep, if message was received after usbPoll()
+	if( usbConfiguration && usbRxLen == 0 ) {
+		sleep_enable();
+		sei();
+		sleep_cpu();
+		sleep_disable();
+	}
+	sei();
+}
+#endif
+
+static inline void initForUsbConnectivity( uchar reconnect ) 
 {
     usbInit();
+#if LOADER_TICKS
+	usbSetupTicks = 0xffff;
+#endif
 	// 
-    usbDeviceDisconnect();
-	_delay_ms( 500 );
-    usbDeviceConnect();
+	if( reconnect ) {
+		usbDeviceDisconnect();
+		_delay_ms( USB_DISCONNECT_MS );
+		usbDeviceConnect();
+	}
 	TCNT1 = 0xff;
     sei();
 }
 
 int main()
 {
+#if FAST_RECONNECT
+	// After power-on host does not know the device yet, so there is nothing to
+	// disconnect. Flag is cleared, next entry from application must reconnect.
+	uchar reconnect = !( MCUSR & _BV(PORF) );
+	MCUSR &= ~_BV(PORF);
+#else
+	uchar reconnect = 1;
+#endif
+
 	wdt_disable();
     bootLoaderInit();
-	tinyFlashInit();
-
-	if( bootLoaderStartCondition() ) {
+	tinyFlashInit();
+
+	if( bootLoaderStartCondition() ) {
 		bootLoaderInitiated();
-		initForUsbConnectivity();
+#if CAN_SERIAL_NUMBER
+		initSerialNumber();
+#endif
+		initForUsbConnectivity( reconnect );
 #ifdef LED_PIN
 		DDRB |= _BV(LED_PIN);
 #endif		
 		TCCR0B = _BV(CS01) | _BV(CS00);
+#if LOADER_IDLE_SLEEP
+		set_sleep_mode( SLEEP_MODE_IDLE );
+#endif
 		do
 		{
 			usbPoll();
+#if LOADER_TICKS
+			loaderTick();
+#endif
+#if LOADER_IDLE_SLEEP
+			// Delay paces only command execution, otherwise wait for the host
+			if( delay == 0 ) sleepIdle();
+			else
+#endif
 			_delay_us( 100 );
 			
 			if( delay != 0 ) {
@@ -358,6 +504,12 @@ int main()
 					//       .
 					cli();
 					if( cmd & DO_ERASE_FLASH ) {
+#				if CAN_CHECK_DATA || CAN_SUPPORT_HUB
+						// With address only one page is erased, so host can rewrite changed pages
+						if( cmd & DO_SET_ADDRESS ) {
+							if( currentAddress < BOOTLOADER_ADDRESS ) boot_page_erase( currentAddress );
+						} else
+#				endif
 						eraseFlash();
 					} 
 					if( cmd & DO_WRITE_FLASH ) {
@@ -109,6 +109,26 @@
 /* define this macro to 1 if you want the function usbMeasureFrameLength()
  * compiled in. This function can be used to calibrate the AVR's RC oscillator.
  */
+#if LOADER_IDLE_TIMEOUT || LOADER_HOST_TIMEOUT
+#undef USB_RESET_HOOK
+#if CAN_SUPPORT_HUB
+#define USB_RESET_HOOK(resetStarts)     if(!resetStarts){ usbHostSeen = 1; cli(); calibrateOscillator(); sei(); }
+#else
+#define USB_RESET_HOOK(resetStarts)     if(!resetStarts){ usbHostSeen = 1; }
+#endif
+#endif
+/* This macro is called from usbPoll() when a USB bus reset starts or ends.
+ * The loader uses the end of reset as a sign that a host is present, see
+ * LOADER_HOST_TIMEOUT in usbloader.h. With CAN_SUPPORT_HUB osccal.h already
+ * hooks it to calibrate the oscillator, so the loader's hook does both.
+ */
+#if LOADER_TICKS
+#define USB_RX_USER_HOOK(data, len)     if(usbSetupTicks == 0xffff){ usbSetupTicks = loaderTicks; }
+#endif
+/* This macro is called from usbPoll() for every message received. The first
+ * message after connect is always a SETUP, so the loader records the time to
+ * enumeration here, see STATUS_SETUP_TICKS in usbloader.h.
+ */
 
 /* -------------------------- Device Description --------------------------- */
 
@@ -234,7 +254,12 @@
 #define USB_CFG_DESCR_PROPS_STRING_0                0
 #define USB_CFG_DESCR_PROPS_STRING_VENDOR           0
 #define USB_CFG_DESCR_PROPS_STRING_PRODUCT          0
+#if CAN_SERIAL_NUMBER
+/* Serial number is built at start-up from the signature row, see main.c */
+#define USB_CFG_DESCR_PROPS_STRING_SERIAL_NUMBER    ( USB_PROP_IS_RAM | USB_PROP_LENGTH( 2 + 2 * SERIAL_NUMBER_LEN ) )
+#else
 #define USB_CFG_DESCR_PROPS_STRING_SERIAL_NUMBER    0
+#endif
 #define USB_CFG_DESCR_PROPS_HID                     0
 #define USB_CFG_DESCR_PROPS_HID_REPORT              0
 #define USB_CFG_DESCR_PROPS_UNKNOWN                 0
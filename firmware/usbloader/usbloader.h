@@ -38,6 +38,48 @@
 #define START_JUMPER_PIN 0
 // Set to 1 for using osccal, and adding some capabilities for USB hub support.
 #define CAN_SUPPORT_HUB 0
+// Set to number of milliseconds without valid report, after which bootloader
+// jumps to application, or 0 to wait forever. Never leaves while flash is empty.
+#define LOADER_IDLE_TIMEOUT 0
+// Set to number of milliseconds to wait for USB reset from the host, after which
+// bootloader jumps to application (charger or dumb supply), or 0 to wait forever.
+#define LOADER_HOST_TIMEOUT 0
+// Set to 1 to bootloader could report its status (see STATUS_* below), or 0 otherwise
+#define CAN_REPORT_STATUS 0
+// Set to 1 to report USB serial number, built from the chip's lot, wafer and
+// die coordinates in the signature row, or 0 to report no serial number.
+// Costs 2 + 4 * SERIAL_NUMBER_BYTES bytes of RAM.
+#define CAN_SERIAL_NUMBER 0
+// Set to 1 to skip USB disconnect after power-on and use the short disconnect
+// otherwise, or 0 to always disconnect for USB_DISCONNECT_MS.
+// Power-on flag is cleared in MCUSR, so application will not see it.
+#define FAST_RECONNECT 0
+
+#if FAST_RECONNECT
+// Hub detects disconnect after 2.5 us of SE0, few ms are enough to latch it
+#define USB_DISCONNECT_MS 10
+#else
+#define USB_DISCONNECT_MS 500
+#endif
+
+// Set to 1 to sleep between USB interrupts while nothing to do, or 0 to poll continuously.
+// Sleep starts after the host configured the device, keep-alive on D- then wakes
+// the loader every millisecond. Timeouts do not run while the bus is suspended.
+#define LOADER_IDLE_SLEEP 0
+
+#if LOADER_IDLE_SLEEP && CAN_SUPPORT_HUB && LOADER_IDLE_TIMEOUT
+#error Idle timeout needs keep-alive wake up, which comes only with interrupt on D-
+#endif
+
+#if CAN_SERIAL_NUMBER
+// Signature row bytes used for serial number, each gives two hex digits
+#define SERIAL_NUMBER_START 0x0E
+#define SERIAL_NUMBER_BYTES 10
+#define SERIAL_NUMBER_LEN ( SERIAL_NUMBER_BYTES * 2 )
+#endif
+
+// Timer0 overflows are counted when any feature needs time
+#define LOADER_TICKS ( LOADER_IDLE_TIMEOUT || LOADER_HOST_TIMEOUT || CAN_REPORT_STATUS )
 
 
 #ifndef BOOTLOADER_ADDRESS
@@ -50,7 +92,21 @@
 	#include <avr/pgmspace.h>
 
 	#define digitalRead(pin) (PINB & _BV(pin))
+	// Application is present, if its reset vector (last page before loader) is not empty
+	#define applicationPresent() ( pgm_read_byte( BOOTLOADER_ADDRESS - 3 ) != 0xff )
+#if LOADER_TICKS
+	// Timer0 overflows (about 1 ms) since USB connect
+	extern volatile uint16_t loaderTicks;
+	// Value of loaderTicks at the first SETUP from the host, 0xffff while not seen
+	extern volatile uint16_t usbSetupTicks;
+#endif
+#if LOADER_IDLE_TIMEOUT || LOADER_HOST_TIMEOUT
+	// Set by USB_RESET_HOOK when the host resets the bus
+	extern volatile uint8_t usbHostSeen;
+	#define bootLoaderCondition() ( !loaderTimeout() )
+#else
 	#define bootLoaderCondition() 1
+#endif
 	
 	// Bootloader start condition. Otherwise jump to application
 	static inline uint8_t bootLoaderStartCondition()
@@ -60,7 +116,7 @@
 		if( !digitalRead( START_JUMPER_PIN ) ) return 1;
 #endif
 		// Start bootloader if INT0 vector contains NOP command (which means than flash is empty)
-		if( pgm_read_byte( BOOTLOADER_ADDRESS - 3 ) == 0xff ) return 1;
+		if( !applicationPresent() ) return 1;
 		// Start bootloader by following application code:
 		// WRITE DOWN THIS CODE IN YOUR APP
 		// cli();
@@ -112,6 +168,47 @@
 // CRC initial value
 #define CRC_INITIAL 0xffff
 
+// Status report. Requested by report with zero command, returned by next GET_REPORT.
+// Offsets are relative to REPORT_DATA
+// Status signature
+#define STATUS_SIGNATURE 0
+#define STATUS_SIGNATURE_VALUE 'S'
+// Capabilities, see STATUS_CAN_*
+#define STATUS_CAPS 1
+// Current flash address, 16 bit
+#define STATUS_ADDRESS 2
+// Timer ticks from USB connect to first SETUP, 16 bit
+#define STATUS_SETUP_TICKS 4
+// Timer ticks per second, 16 bit
+#define STATUS_TICK_RATE 6
+// Timer ticks since USB connect, 16 bit
+#define STATUS_TICKS 8
+// Second signature, 16 bit. With STATUS_SIGNATURE it tells the status from flash data
+// returned by a loader without CAN_REPORT_STATUS
+#define STATUS_MAGIC 10
+#define STATUS_MAGIC_VALUE 0x4c54
+
+#define STATUS_CAN_ERASE_EEPROM 0x01
+#define STATUS_CAN_READ_FLASH 0x02
+#define STATUS_CAN_LEAVE_LOADER 0x04
+#define STATUS_CAN_CHECK_DATA 0x08
+#define STATUS_CAN_SET_ADDRESS 0x10
+// Erase command with DO_SET_ADDRESS erases only the page at given address
+#define STATUS_CAN_ERASE_PAGE 0x20
+// DO_FILL_FLASH with DO_FILL_PART takes only the data of the first 8 byte packet
+#define STATUS_CAN_FILL_PART 0x40
+
+#define STATUS_CAPS_VALUE ( \
+	( CAN_ERASE_EEPROM ? STATUS_CAN_ERASE_EEPROM : 0 ) | \
+	( CAN_READ_FLASH ? STATUS_CAN_READ_FLASH : 0 ) | \
+	( CAN_LEAVE_LOADER ? STATUS_CAN_LEAVE_LOADER : 0 ) | \
+	( CAN_CHECK_DATA ? STATUS_CAN_CHECK_DATA : 0 ) | \
+	( CAN_CHECK_DATA || CAN_SUPPORT_HUB ? STATUS_CAN_SET_ADDRESS | STATUS_CAN_ERASE_PAGE : 0 ) | \
+	( CAN_SUPPORT_HUB ? STATUS_CAN_FILL_PART : 0 ) )
+
+// Timer0 runs with prescaler 64, so it overflows about once per millisecond
+#define TIMER0_TICK_RATE ( F_CPU / 64 / 256 )
+
 
 
 #define LOADER_VECTOR ( 0xC000 + ( BOOTLOADER_ADDRESS / 2 ) - 1 )
@@ -0,0 +1,369 @@
+﻿using System;
+using System.Collections.Generic;
+using System.Diagnostics;
+using System.IO;
+using System.Text;
+
+namespace DeliSu.TinyHidLoader.Benchmarks
+{
+    /// <summary>
+    /// Тело замера, выполняется много раз подряд
+    /// </summary>
+    delegate void BenchmarkBody();
+
+    class Program
+    {
+        // Each benchmark runs at least this long after warmup
+        const int MIN_TIME_MS = 500;
+        const int WARMUP = 20;
+        const int IMAGE_SIZE = 6000;
+
+        static readonly Random random = new Random(1);
+
+        static int Main(string[] args)
+        {
+            bool paced = false;
+            string filter = null;
+            foreach (string arg in args)
+            {
+                if (arg == "paced") paced = true;
+                else filter = arg;
+            }
+
+            if (!ValidateCrc16()) return 1;
+
+            string temp = Path.Combine(Path.GetTempPath(), "TinyHidLoader.Benchmarks." + Process.GetCurrentProcess().Id);
+            Directory.CreateDirectory(temp);
+            try
+            {
+                if (!ValidateLinkModes(temp)) return 1;
+
+                Console.WriteLine("{0,-32} {1,10} {2,14} {3,12}", "benchmark", "ops", "ns/op", "bytes/op");
+                Console.WriteLine(new string('-', 71));
+                Checksums(filter);
+                Hex(filter, temp);
+                Flash(filter, temp);
+                if (paced) Paced();
+            }
+            finally
+            {
+                Directory.Delete(temp, true);
+            }
+            return 0;
+        }
+
+        static byte[] RandomBytes(int count)
+        {
+            byte[] data = new byte[count];
+            random.NextBytes(data);
+            return data;
+        }
+
+        /// <summary>
+        /// Сверяет табличный crc16 с побитовым _crc16_update() на случайных данных
+        /// </summary>
+        static bool ValidateCrc16()
+        {
+            // CRC-16/MODBUS check value, the same polynomial and initial value
+            byte[] check = Encoding.ASCII.GetBytes("123456789");
+            if (Crc16Table.Compute(check, 0, check.Length) != 0x4B37)
+            {
+                Console.WriteLine("Crc16Table: check value mismatch");
+                return false;
+            }
+            for (int run = 0; run < 20000; run++)
+            {
+                byte[] data = RandomBytes(random.Next(1, 300));
+                int offset = random.Next(data.Length);
+                int count = random.Next(data.Length - offset + 1);
+                ushort initial = (ushort)random.Next(0x10000);
+                ushort expected = initial;
+                for (int i = 0; i < count; i++) expected = Crc16Table.UpdateBitwise(expected, data[offset + i]);
+                ushort actual = Crc16Table.Update(initial, data, offset, count);
+                if (actual != expected)
+                {
+                    Console.WriteLine("Crc16Table: mismatch at {0} bytes from 0x{1:X4}: 0x{2:X4} instead of 0x{3:X4}",
+                        count, initial, actual, expected);
+                    return false;
+                }
+            }
+            Console.WriteLine("Crc16Table matches bitwise _crc16_update");
+            return true;
+        }
+
+        /// <summary>
+        /// Хаб, который теряет каждый второй полный отчёт с данными
+        /// </summary>
+        class LossyHub : ILoaderTransport
+        {
+            readonly ILoaderTransport transport;
+            bool lose;
+
+            /// <summary>
+            /// Отправлено частей страницы
+            /// </summary>
+            public int Parts { get; private set; }
+
+            public LossyHub(ILoaderTransport transport)
+            {
+                this.transport = transport;
+            }
+
+            public void SetFeature(byte[] report)
+            {
+                LoaderCommand cmd = (LoaderCommand)report[Loader.REPORT_COMMAND];
+                if ((cmd & LoaderCommand.FillPart) != 0)
+                {
+                    Parts++;
+                }
+                else if ((cmd & LoaderCommand.FillFlash) != 0)
+                {
+                    lose = !lose;
+                    if (lose) throw new IOException("report lost by hub");
+                }
+                transport.SetFeature(report);
+            }
+
+            public void GetFeature(byte[] report)
+            {
+                transport.GetFeature(report);
+            }
+
+            public void Dispose()
+            {
+                transport.Dispose();
+            }
+        }
+
+        /// <summary>
+        /// Сверяет запись с сохранённым режимом "parts": по частям пишет только загрузчик, сообщивший FillPart
+        /// </summary>
+        static bool ValidateLinkModes(string temp)
+        {
+            byte[] data = RandomBytes(IMAGE_SIZE);
+            FlashImage image = new FlashImage(Loader.LOADERSTART);
+            image.Write(0, data, 0, data.Length);
+            string links = Path.Combine(temp, "links");
+
+            for (int kind = 0; kind < 3; kind++)
+            {
+                // Default firmware build: no data check, no flash reading
+                EmulatedDevice device = CreateDevice();
+                device.CanCheckData = false;
+                device.CanReadFlash = false;
+                device.CanSupportHub = kind == 0;
+                device.CanReportStatus = kind != 1;
+                string name = kind == 0 ? "hub loader" : kind == 1 ? "loader without status" : "loader without hub support";
+
+                // As if an earlier run had switched this port to parts
+                string devicePath = "link" + kind;
+                LinkQuality saved = LinkQuality.Load(links, devicePath);
+                for (int i = 0; i < 4; i++) saved.FullTried(false);
+                saved.Save();
+
+                LoaderPacer pacer = CreateImmediatePacer();
+                pacer.Link = LinkQuality.Load(links, devicePath);
+                LossyHub hub = new LossyHub(device.Open());
+                using (LoaderSession session = new LoaderSession(hub, pacer))
+                    session.WriteFlash(image);
+
+                if ((hub.Parts != 0) != device.CanSupportHub)
+                {
+                    Console.WriteLine("LinkQuality: {0} sent {1} parts", name, hub.Parts);
+                    return false;
+                }
+                // The reset and PCINT vectors are redirected to the loader
+                byte[] flash = device.Flash;
+                for (int i = 6; i < IMAGE_SIZE; i++)
+                {
+                    if (flash[i] != data[i])
+                    {
+                        Console.WriteLine("LinkQuality: {0} wrote 0x{1:X2} at 0x{2:X4} instead of 0x{3:X2}", name, flash[i], i, data[i]);
+                        return false;
+                    }
+                }
+            }
+            Console.WriteLine("Saved parts mode is used only by a loader that reports FillPart");
+            return true;
+        }
+
+        static void Checksums(string filter)
+        {
+            byte[] page = RandomBytes(Loader.PAGESIZE);
+            byte[] report = RandomBytes(Loader.REPORT_SIZE);
+            byte[] image = RandomBytes(Loader.LOADERSTART);
+            ushort sink = 0;
+
+            Measure(filter, "Crc16 bitwise (64 B)", delegate
+            {
+                ushort crc = Crc16Table.INITIAL;
+                for (int i = 0; i < page.Length; i++) crc = Crc16Table.UpdateBitwise(crc, page[i]);
+                sink ^= crc;
+            });
+            Measure(filter, "Loader.Crc16 (64 B)", delegate { sink ^= Loader.Crc16(page, 0, page.Length); });
+            Measure(filter, "Loader.Crc16 (6 KB)", delegate { sink ^= Loader.Crc16(image, 0, image.Length); });
+            Measure(filter, "Loader.Crc8 (64 B)", delegate { sink ^= Loader.Crc8(page, 0, page.Length); });
+            Measure(filter, "Loader.SignBuffer", delegate { Loader.SignBuffer(report); });
+            GC.KeepAlive(sink);
+        }
+
+        static void Hex(string filter, string temp)
+        {
+            HexFile source = new HexFile();
+            source.Chunks.Add(new HexFile.HexChunk(0, RandomBytes(IMAGE_SIZE)));
+            string path = Path.Combine(temp, "image.hex");
+            source.Write(path);
+            byte[] text = File.ReadAllBytes(path);
+
+            Measure(filter, "HexFile.Open(file)", delegate
+            {
+                new HexFile(path);
+            });
+            Measure(filter, "HexFile.Open(stream)", delegate
+            {
+                new HexFile().Open(new MemoryStream(text, false));
+            });
+            string output = Path.Combine(temp, "output.hex");
+            Measure(filter, "HexFile.Write", delegate
+            {
+                source.Write(output);
+            });
+
+            byte[] first = RandomBytes(4096);
+            HexFile.HexChunk second = new HexFile.HexChunk(2048, RandomBytes(4096));
+            Measure(filter, "HexChunk.Combine (4K+4K)", delegate
+            {
+                new HexFile.HexChunk(0, first).Combine(second);
+            });
+
+            Measure(filter, "FlashImage.FromHex", delegate
+            {
+                FlashImage.FromHex(source, Loader.LOADERSTART);
+            });
+
+            FlashImage image = FlashImage.FromHex(source, Loader.LOADERSTART);
+            Measure(filter, "FlashPlan.Create", delegate
+            {
+                FlashPlan.Create(image);
+            });
+            MemoryStream planFile = new MemoryStream();
+            FlashPlan.Create(image).Save(planFile);
+            byte[] planData = planFile.ToArray();
+            Measure(filter, "FlashPlan.Load", delegate
+            {
+                FlashPlan.Load(new MemoryStream(planData, false));
+            });
+        }
+
+        /// <summary>
+        /// Эмулированное устройство без задержек: замеряется только работа хоста
+        /// </summary>
+        static EmulatedDevice CreateDevice()
+        {
+            EmulatedDevice device = new EmulatedDevice();
+            device.CanCheckData = true;
+            device.CanReadFlash = true;
+            device.CanReportStatus = true;
+            device.CommitDelayMs = 0;
+            device.PageWriteMs = 0;
+            device.PageEraseMs = 0;
+            device.EepromWriteMs = 0;
+            return device;
+        }
+
+        static LoaderPacer CreateImmediatePacer()
+        {
+            return new LoaderPacer(
+                new AdaptiveDelay("page", 0, 0, 0, 0),
+                new AdaptiveDelay("erase", 0, 0, 0, 0),
+                new AdaptiveDelay("retry", 0, 0, 0, 0),
+                new AdaptiveDelay("part", 0, 0, 0, 0));
+        }
+
+        static void Flash(string filter, string temp)
+        {
+            FlashImage image = new FlashImage(Loader.LOADERSTART);
+            byte[] data = RandomBytes(IMAGE_SIZE);
+            image.Write(0, data, 0, data.Length);
+            byte[] buffer = new byte[Loader.LOADERSTART];
+
+            EmulatedDevice device = CreateDevice();
+            using (LoaderSession session = new LoaderSession(device.Open(), CreateImmediatePacer()))
+            {
+                Measure(filter, "WriteFlash (emulated)", delegate { session.WriteFlash(image); });
+                FlashPlan plan = FlashPlan.Create(image);
+                Measure(filter, "WriteFlash plan (emulated)", delegate { session.WriteFlash(plan); });
+                Measure(filter, "ReadFlash (emulated)", delegate { session.ReadFlash(buffer, 0); });
+                Measure(filter, "VerifyFlash (emulated)", delegate { session.VerifyFlash(image); });
+
+                DeltaCache cache = new DeltaCache(Path.Combine(temp, "cache"));
+                session.WriteFlash(image, cache, "bench");
+                Measure(filter, "WriteFlash delta (emulated)", delegate { session.WriteFlash(image, cache, "bench"); });
+
+                device.ResetStatistics();
+                session.WriteFlash(image);
+                Console.WriteLine("  full write on wire: {0} bytes, {1} reports, {2} page writes",
+                    device.BytesOnWire, device.SetReports, device.PageWrites);
+                device.ResetStatistics();
+                session.WriteFlash(image, cache, "bench");
+                Console.WriteLine("  delta write on wire: {0} bytes, {1} reports, {2} page writes",
+                    device.BytesOnWire, device.SetReports, device.PageWrites);
+            }
+        }
+
+        /// <summary>
+        /// Полная запись с задержками прошивки и адаптивными паузами хоста, как на плате
+        /// </summary>
+        static void Paced()
+        {
+            FlashImage image = new FlashImage(Loader.LOADERSTART);
+            byte[] data = RandomBytes(IMAGE_SIZE);
+            image.Write(0, data, 0, data.Length);
+
+            Console.WriteLine();
+            Console.WriteLine("paced WriteFlash against emulated timing:");
+            EmulatedDevice device = new EmulatedDevice();
+            Loader ldr = new Loader(device);
+            for (int run = 1; run <= 3; run++)
+            {
+                device.ResetStatistics();
+                Stopwatch watch = Stopwatch.StartNew();
+                ldr.WriteFlash(image);
+                Console.WriteLine("  run {0}: {1} ms, {2}", run, watch.ElapsedMilliseconds, device);
+                // Let the last page commit before the next run
+                System.Threading.Thread.Sleep(20);
+            }
+            Console.WriteLine("  {0}", ldr.Pacer);
+        }
+
+        static void Measure(string filter, string name, BenchmarkBody body)
+        {
+            if (filter != null && name.IndexOf(filter, StringComparison.OrdinalIgnoreCase) < 0) return;
+
+            for (int i = 0; i < WARMUP; i++) body();
+            GC.Collect();
+            GC.WaitForPendingFinalizers();
+
+            long count = 1;
+            while (true)
+            {
+                long allocated = GC.GetAllocatedBytesForCurrentThread();
+                Stopwatch watch = Stopwatch.StartNew();
+                for (long i = 0; i < count; i++) body();
+                watch.Stop();
+                allocated = GC.GetAllocatedBytesForCurrentThread() - allocated;
+                if (watch.ElapsedMilliseconds >= MIN_TIME_MS)
+                {
+                    double ns = watch.Elapsed.TotalMilliseconds * 1e6 / count;
+                    Console.WriteLine("{0,-32} {1,10} {2,14:N1} {3,12:N0}", name, count, ns, (double)allocated / count);
+                    return;
+                }
+                // Aim straight at the target time once the loop is long enough to time
+                if (watch.ElapsedMilliseconds < 10)
+                    count *= 10;
+                else
+                    count = count * MIN_TIME_MS / watch.ElapsedMilliseconds + 1;
+            }
+        }
+    }
+}
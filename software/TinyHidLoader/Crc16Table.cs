@@ -0,0 +1,94 @@
+﻿using System;
+using System.Collections.Generic;
+using System.Text;
+
+namespace DeliSu.TinyHidLoader
+{
+    /// <summary>
+    /// crc16 загрузчика по таблицам, 8 байт за шаг
+    /// </summary>
+    /// <remarks>
+    /// Тот же crc16, что и _crc16_update() из avr-libc в firmware/usbloader и firmware/reloader:
+    /// отражённый полином 0xA001, загрузчик начинает с 0xffff. Вычисление продолжается с любого места:
+    /// <code>crc = Crc16Table.Update(Crc16Table.Update(0xffff, a, 0, a.Length), b, 0, b.Length);</code>
+    /// </remarks>
+    public static class Crc16Table
+    {
+        const ushort POLYNOMIAL = 0xA001;
+
+        public const ushort INITIAL = 0xffff;
+
+        // tables[k][b] - crc of byte b followed by k zero bytes, starting from 0
+        static readonly ushort[][] tables = CreateTables();
+
+        static ushort[][] CreateTables()
+        {
+            ushort[][] result = new ushort[8][];
+            for (int k = 0; k < result.Length; k++) result[k] = new ushort[256];
+            for (int b = 0; b < 256; b++) result[0][b] = UpdateBitwise(0, (byte)b);
+            for (int k = 1; k < result.Length; k++)
+            {
+                for (int b = 0; b < 256; b++)
+                {
+                    ushort prev = result[k - 1][b];
+                    result[k][b] = (ushort)((prev >> 8) ^ result[0][prev & 0xff]);
+                }
+            }
+            return result;
+        }
+
+        /// <summary>
+        /// Эталонный побитовый расчёт, как в _crc16_update()
+        /// </summary>
+        public static ushort UpdateBitwise(ushort crc, byte data)
+        {
+            crc ^= data;
+            for (int i = 0; i < 8; ++i)
+            {
+                if ((crc & 1) != 0)
+                    crc = (ushort)((crc >> 1) ^ POLYNOMIAL);
+                else
+                    crc = (ushort)(crc >> 1);
+            }
+            return crc;
+        }
+
+        public static ushort Update(ushort crc, byte data)
+        {
+            return (ushort)((crc >> 8) ^ tables[0][(crc ^ data) & 0xff]);
+        }
+
+        /// <summary>
+        /// Продолжает crc16 по участку массива
+        /// </summary>
+        public static ushort Update(ushort crc, byte[] buffer, int offset, int count)
+        {
+            if (offset < 0 || count < 0 || offset > buffer.Length - count)
+                throw new ArgumentOutOfRangeException("count");
+
+            ushort[] t0 = tables[0], t1 = tables[1], t2 = tables[2], t3 = tables[3];
+            ushort[] t4 = tables[4], t5 = tables[5], t6 = tables[6], t7 = tables[7];
+            int value = crc;
+            for (; count >= 8; offset += 8, count -= 8)
+            {
+                // Only the first two bytes meet the 16-bit register, the rest go through the tables as is
+                value ^= buffer[offset] | (buffer[offset + 1] << 8);
+                value = t7[value & 0xff] ^ t6[value >> 8] ^
+                    t5[buffer[offset + 2]] ^ t4[buffer[offset + 3]] ^
+                    t3[buffer[offset + 4]] ^ t2[buffer[offset + 5]] ^
+                    t1[buffer[offset + 6]] ^ t0[buffer[offset + 7]];
+            }
+            for (; count > 0; offset++, count--)
+                value = (value >> 8) ^ t0[(value ^ buffer[offset]) & 0xff];
+            return (ushort)value;
+        }
+
+        /// <summary>
+        /// crc16 участка массива, начиная с 0xffff
+        /// </summary>
+        public static ushort Compute(byte[] buffer, int offset, int count)
+        {
+            return Update(INITIAL, buffer, offset, count);
+        }
+    }
+}
@@ -0,0 +1,137 @@
+﻿using System;
+using System.Collections.Generic;
+using System.IO;
+using System.Text;
+
+namespace DeliSu.TinyHidLoader
+{
+    /// <summary>
+    /// Кэш crc16 страниц последней успешной записи, по серийному номеру устройства
+    /// </summary>
+    /// <remarks>
+    /// Запись удаляется перед началом записи FLASH и сохраняется после успешного завершения.
+    /// Если запись прервалась, а загрузчик сообщает состояние и умеет писать отдельные страницы,
+    /// сохраняется журнал: подтверждённые страницы со своими crc16, стёртые - с crc16 стёртой
+    /// страницы, недописанная - с заведомо неверным, так что следующая запись досылает только
+    /// недостающие. Без такого загрузчика
+    /// прерванная запись приводит к полной перезаписи.
+    /// Очистка и запись FLASH через Loader без кэша удаляют запись устройства,
+    /// а изменения в обход этой библиотеки (другой компьютер, программатор) кэш не видит.
+    /// </remarks>
+    public class DeltaCache
+    {
+        const uint MAGIC = 0x43484c54; // "TLHC"
+        const int VERSION = 1;
+
+        // Entries of a cache without directory, kept only while the process runs
+        readonly Dictionary<string, ushort[]> memory;
+
+        /// <summary>
+        /// Каталог кэша, или null для кэша в памяти
+        /// </summary>
+        public string Directory { get; private set; }
+
+        /// <summary>
+        /// Каталог кэша по умолчанию, в локальных данных пользователя
+        /// </summary>
+        public static string DefaultDirectory
+        {
+            get
+            {
+                return Path.Combine(Path.Combine(Environment.GetFolderPath(Environment.SpecialFolder.LocalApplicationData),
+                    "TinyHidLoader"), "cache");
+            }
+        }
+
+        public DeltaCache()
+            : this(DefaultDirectory)
+        {
+        }
+
+        /// <param name="directory">Каталог кэша, или null, чтобы держать записи только в памяти</param>
+        public DeltaCache(string directory)
+        {
+            Directory = directory;
+            if (directory == null) memory = new Dictionary<string, ushort[]>();
+        }
+
+        private string GetPath(string serial)
+        {
+            StringBuilder name = new StringBuilder();
+            foreach (char c in serial)
+                name.Append(char.IsLetterOrDigit(c) ? c : '_');
+            return Path.Combine(Directory, name.ToString() + ".crc");
+        }
+
+        /// <summary>
+        /// Читает crc16 страниц последней записи
+        /// </summary>
+        /// <param name="serial">Серийный номер устройства</param>
+        /// <param name="pages">Ожидаемое количество страниц</param>
+        /// <returns>crc16 страниц, или null, если записи нет или она не подходит</returns>
+        public ushort[] Load(string serial, int pages)
+        {
+            if (memory != null)
+            {
+                ushort[] crcs;
+                if (!memory.TryGetValue(serial, out crcs) || crcs.Length != pages) return null;
+                return (ushort[])crcs.Clone();
+            }
+            string path = GetPath(serial);
+            if (!File.Exists(path)) return null;
+            try
+            {
+                using (BinaryReader reader = new BinaryReader(File.OpenRead(path)))
+                {
+                    if (reader.ReadUInt32() != MAGIC || reader.ReadInt32() != VERSION) return null;
+                    if (reader.ReadInt32() != pages) return null;
+                    ushort[] result = new ushort[pages];
+                    for (int i = 0; i < pages; i++) result[i] = reader.ReadUInt16();
+                    return result;
+                }
+            }
+            catch (IOException)
+            {
+                return null;
+            }
+        }
+
+        /// <summary>
+        /// Сохраняет crc16 страниц успешной записи
+        /// </summary>
+        public void Save(string serial, ushort[] crcs)
+        {
+            if (memory != null)
+            {
+                memory[serial] = (ushort[])crcs.Clone();
+                return;
+            }
+            System.IO.Directory.CreateDirectory(Directory);
+            string path = GetPath(serial);
+            string temp = path + ".tmp";
+            using (BinaryWriter writer = new BinaryWriter(File.Create(temp)))
+            {
+                writer.Write(MAGIC);
+                writer.Write(VERSION);
+                writer.Write(crcs.Length);
+                foreach (ushort crc in crcs) writer.Write(crc);
+            }
+            if (File.Exists(path)) File.Delete(path);
+            File.Move(temp, path);
+        }
+
+        /// <summary>
+        /// Удаляет запись устройства
+        /// </summary>
+        public void Invalidate(string serial)
+        {
+            if (memory != null)
+            {
+                memory.Remove(serial);
+                return;
+            }
+            string path = GetPath(serial);
+            if (File.Exists(path)) File.Delete(path);
+        }
+    }
+}
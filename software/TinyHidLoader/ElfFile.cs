@@ -0,0 +1,159 @@
+﻿using System;
+using System.Collections.Generic;
+using System.IO;
+using System.Text;
+
+namespace DeliSu
+{
+    /// <summary>
+    /// Программа из ELF файла avr-gcc (main.bin), без преобразования в HEX
+    /// </summary>
+    /// <remarks>
+    /// Читаются загружаемые сегменты (PT_LOAD) по физическим адресам, как их пишет avr-objcopy:
+    /// .text и начальные значения .data попадают во FLASH, .eeprom - в EEPROM по адресу 0x810000.
+    /// Каждый сегмент становится отдельным участком, смежные участки сливаются,
+    /// так что пропуски между сегментами не записываются.
+    /// Файл читается одним блоком: в .NET 3.5 отображения файлов в память нет.
+    /// </remarks>
+    public class ElfFile
+    {
+        const uint MAGIC = 0x464c457f; // "\x7fELF"
+        const byte ELFCLASS32 = 1;
+        const byte ELFDATA2LSB = 1;
+        const int EM_AVR = 83;
+        const uint PT_LOAD = 1;
+        const int HEADER_SIZE = 52;
+        const int PROGRAM_HEADER_SIZE = 32;
+
+        // avr-gcc address spaces: flash from 0, RAM from 0x800000, EEPROM from 0x810000, then fuses, lock bits, signature
+        public const long DATA_SPACE = 0x800000;
+        public const long EEPROM_SPACE = 0x810000;
+        const long EEPROM_SPACE_END = 0x820000;
+
+        /// <summary>
+        /// Содержимое FLASH
+        /// </summary>
+        public HexFile Flash { get; private set; }
+
+        /// <summary>
+        /// Содержимое EEPROM, адреса от начала EEPROM
+        /// </summary>
+        public HexFile Eeprom { get; private set; }
+
+        /// <summary>
+        /// Количество пропущенных сегментов: фьюзы, lock биты, сигнатура
+        /// </summary>
+        public int SkippedSegments { get; private set; }
+
+        public ElfFile(string filename)
+        {
+            using (FileStream stream = new FileStream(filename, FileMode.Open, FileAccess.Read, FileShare.Read))
+            {
+                Open(stream);
+            }
+        }
+
+        public ElfFile(Stream stream)
+        {
+            Open(stream);
+        }
+
+        /// <summary>
+        /// Файл начинается с сигнатуры ELF
+        /// </summary>
+        public static bool IsElf(string filename)
+        {
+            using (FileStream stream = new FileStream(filename, FileMode.Open, FileAccess.Read, FileShare.Read))
+            {
+                byte[] magic = new byte[4];
+                return stream.Read(magic, 0, magic.Length) == magic.Length && ReadUInt(magic, 0) == MAGIC;
+            }
+        }
+
+        private void Open(Stream stream)
+        {
+            byte[] elf = ReadAll(stream);
+            if (elf.Length < HEADER_SIZE || ReadUInt(elf, 0) != MAGIC)
+                throw new FormatException("not an ELF file");
+            if (elf[4] != ELFCLASS32 || elf[5] != ELFDATA2LSB || ReadUShort(elf, 18) != EM_AVR)
+                throw new FormatException("not an AVR ELF file");
+
+            long phoff = ReadUInt(elf, 28);
+            int phentsize = ReadUShort(elf, 42);
+            int phnum = ReadUShort(elf, 44);
+            if (phentsize < PROGRAM_HEADER_SIZE || phoff + (long)phentsize * phnum > elf.Length)
+                throw new FormatException("ELF program headers are truncated");
+
+            Flash = new HexFile();
+            Eeprom = new HexFile();
+            for (int i = 0; i < phnum; i++)
+            {
+                int ph = (int)phoff + i * phentsize;
+                if (ReadUInt(elf, ph) != PT_LOAD) continue;
+                long offset = ReadUInt(elf, ph + 4);
+                long address = ReadUInt(elf, ph + 12);
+                long size = ReadUInt(elf, ph + 16);
+                // .bss and .noinit occupy RAM only
+                if (size == 0) continue;
+                if (offset + size > elf.Length)
+                    throw new FormatException("ELF segment " + i + " is truncated");
+
+                HexFile target;
+                if (address < DATA_SPACE)
+                {
+                    target = Flash;
+                }
+                else if (address >= EEPROM_SPACE && address < EEPROM_SPACE_END)
+                {
+                    target = Eeprom;
+                    address -= EEPROM_SPACE;
+                }
+                else
+                {
+                    SkippedSegments++;
+                    continue;
+                }
+                byte[] data = new byte[size];
+                Buffer.BlockCopy(elf, (int)offset, data, 0, (int)size);
+                Add(target, new HexFile.HexChunk(address, data));
+            }
+        }
+
+        /// <summary>
+        /// Добавляет участок, сливая его с перекрывающимися и смежными
+        /// </summary>
+        private static void Add(HexFile file, HexFile.HexChunk chunk)
+        {
+            for (int i = file.Chunks.Count - 1; i >= 0; i--)
+            {
+                if (!file.Chunks[i].Intersect(chunk)) continue;
+                HexFile.HexChunk other = file.Chunks[i];
+                file.Chunks.RemoveAt(i);
+                // Later segment wins where they overlap
+                other.Combine(chunk);
+                chunk = other;
+            }
+            file.Chunks.Add(chunk);
+            file.Chunks.Sort(delegate(HexFile.HexChunk x, HexFile.HexChunk y) { return x.Offset.CompareTo(y.Offset); });
+        }
+
+        private static byte[] ReadAll(Stream stream)
+        {
+            MemoryStream data = new MemoryStream();
+            byte[] block = new byte[4096];
+            int readed;
+            while ((readed = stream.Read(block, 0, block.Length)) > 0) data.Write(block, 0, readed);
+            return data.ToArray();
+        }
+
+        private static int ReadUShort(byte[] buffer, int pos)
+        {
+            return buffer[pos] | (buffer[pos + 1] << 8);
+        }
+
+        private static uint ReadUInt(byte[] buffer, int pos)
+        {
+            return (uint)(buffer[pos] | (buffer[pos + 1] << 8) | (buffer[pos + 2] << 16) | (buffer[pos + 3] << 24));
+        }
+    }
+}
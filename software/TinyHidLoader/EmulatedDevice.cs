@@ -0,0 +1,599 @@
+﻿using System;
+using System.Collections.Generic;
+using System.Diagnostics;
+using System.IO;
+using System.Text;
+using System.Threading;
+
+namespace DeliSu.TinyHidLoader
+{
+    /// <summary>
+    /// Загрузчик TinyHID, эмулированный в памяти
+    /// </summary>
+    /// <remarks>
+    /// Повторяет firmware/usbloader/main.c: приём отчёта кусками по 8 байт в usbFunctionWrite()
+    /// с защёлкиванием команды, флаги DO_*, перенос векторов сброса и PCINT, проверку crc16,
+    /// отложенное выполнение команды в главном цикле и запись страниц через буфер SPM.
+    /// Пока команда не выполнена, новый отчёт получает STALL, а пока идёт SPM, устройство не отвечает вовсе;
+    /// и то, и другое выходит из транспорта исключением IOException, как у настоящего устройства.
+    /// Время идёт по настоящим часам, так что задержки хоста проверяются честно.
+    /// Опции CAN_* задаются свойствами до начала работы, по умолчанию - как в usbloader.h.
+    /// </remarks>
+    public class EmulatedDevice : ILoaderDevice
+    {
+        const int BOOTLOADER_ADDRESS = 0x1800;
+        const int FLASH_SIZE = 0x2000;
+        const int EEPROM_SIZE = 512;
+        const int E2END = EEPROM_SIZE - 1;
+        const int SPM_PAGESIZE = Loader.PAGESIZE;
+        // Report without report id, as usbFunctionWrite() sees it
+        const int LOADER_REPORT_SIZE = SPM_PAGESIZE + 4;
+        const int REPORT_COMMAND = 0;
+        const int REPORT_CRC = 1;
+        const int REPORT_CMD_CHECK = 3;
+        const int REPORT_DATA = 4;
+        const int CHUNK = 8;
+
+        const int DO_RESET_ADDRESS = 0x01;
+        const int DO_SET_ADDRESS = 0x02;
+        const int DO_WRITE_FLASH = 0x04;
+        const int DO_FILL_FLASH = 0x08;
+        const int DO_FILL_PART = 0x10;
+        const int DO_ERASE_FLASH = 0x20;
+        const int DO_ERASE_EEPROM = 0x40;
+        const int DO_LEAVE_BOOTLOADER = 0x80;
+
+        const int LOADER_VECTOR = 0xC000 + BOOTLOADER_ADDRESS / 2 - 1;
+        const int APP_RESET_SHIFT = (FLASH_SIZE - BOOTLOADER_ADDRESS) / 2 + 2;
+        const int APP_PCINT_SHIFT = (FLASH_SIZE - BOOTLOADER_ADDRESS) / 2 + 1 + 2;
+        const int APP_RESET_ADDR = BOOTLOADER_ADDRESS - 4;
+        const int APP_PCINT_ADDR = BOOTLOADER_ADDRESS - 2;
+        const int RESET_ADDR = 0;
+        const int PCINT_ADDR = 4;
+
+        // F_CPU / 64 / 256
+        const int TIMER0_TICK_RATE = 16500000 / 64 / 256;
+        const int NOT_SEEN = 0xffff;
+        // STATUS_MAGIC_VALUE
+        const int STATUS_MAGIC = 0x4c54;
+
+        // Low speed packet overhead without bit stuffing: sync + PID + address/CRC5, sync + PID + CRC16, sync + PID
+        const int TOKEN_BYTES = 4;
+        const int DATA_OVERHEAD = 4;
+        const int HANDSHAKE_BYTES = 2;
+
+        static int instances;
+
+        readonly object sync = new object();
+        readonly string path;
+        readonly Stopwatch clock = new Stopwatch();
+        readonly byte[] flash = new byte[FLASH_SIZE];
+        readonly byte[] eeprom = new byte[EEPROM_SIZE];
+        readonly byte[] pageBuffer = new byte[SPM_PAGESIZE];
+        readonly byte[] exchangeReport = new byte[LOADER_REPORT_SIZE];
+        readonly int[] vectors = new int[2];
+
+        int offset;
+        int currentAddress;
+        int cmd;
+        ushort crc;
+        ushort sign;
+        bool statusRequested;
+        bool connected;
+        int setupTicks;
+        // Command is latched and waits for main loop
+        bool pending;
+        double commitAt;
+        // Interrupts are off while SPM or EEPROM write runs
+        double busyUntil;
+
+        public bool CanEraseEeprom { get; set; }
+        public bool CanReadFlash { get; set; }
+        public bool CanLeaveLoader { get; set; }
+        public bool CanCheckData { get; set; }
+        public bool CanSupportHub { get; set; }
+        public bool CanReportStatus { get; set; }
+
+        /// <summary>
+        /// Задержка от приёма отчёта до выполнения команды в главном цикле, мс
+        /// </summary>
+        public double CommitDelayMs { get; set; }
+
+        /// <summary>
+        /// Время записи страницы FLASH, мс
+        /// </summary>
+        public double PageWriteMs { get; set; }
+
+        /// <summary>
+        /// Время очистки страницы FLASH, мс
+        /// </summary>
+        public double PageEraseMs { get; set; }
+
+        /// <summary>
+        /// Время записи байта EEPROM, мс
+        /// </summary>
+        public double EepromWriteMs { get; set; }
+
+        /// <summary>
+        /// Серийный номер, или null для загрузчика без него
+        /// </summary>
+        public string SerialNumber { get; set; }
+
+        /// <summary>
+        /// Байт на шине с учётом служебных пакетов, без битстаффинга
+        /// </summary>
+        public long BytesOnWire { get; private set; }
+
+        /// <summary>
+        /// Принято отчётов SET_REPORT
+        /// </summary>
+        public int SetReports { get; private set; }
+
+        /// <summary>
+        /// Отдано отчётов GET_REPORT
+        /// </summary>
+        public int GetReports { get; private set; }
+
+        /// <summary>
+        /// Записано страниц FLASH
+        /// </summary>
+        public int PageWrites { get; private set; }
+
+        /// <summary>
+        /// Очищено страниц FLASH
+        /// </summary>
+        public int PageErases { get; private set; }
+
+        /// <summary>
+        /// Отчётов, отвергнутых STALL
+        /// </summary>
+        public int Stalls { get; private set; }
+
+        /// <summary>
+        /// Обращений, пока устройство не отвечало
+        /// </summary>
+        public int Timeouts { get; private set; }
+
+        public EmulatedDevice()
+        {
+            path = "emulated:" + Interlocked.Increment(ref instances);
+            CanLeaveLoader = true;
+            CommitDelayMs = 1.2;
+            PageWriteMs = 4.5;
+            PageEraseMs = 4.5;
+            EepromWriteMs = 3.4;
+            for (int i = 0; i < flash.Length; i++) flash[i] = 0xff;
+            for (int i = 0; i < eeprom.Length; i++) eeprom[i] = 0xff;
+            // Stand-in for the bootloader code, so it differs from erased flash
+            for (int i = BOOTLOADER_ADDRESS; i < FLASH_SIZE; i++) flash[i] = 0;
+            Reconnect();
+        }
+
+        /// <summary>
+        /// Содержимое FLASH, включая область загрузчика, с учётом уже выполненных команд
+        /// </summary>
+        public byte[] Flash
+        {
+            get
+            {
+                lock (sync)
+                {
+                    Update();
+                    return flash;
+                }
+            }
+        }
+
+        public byte[] Eeprom
+        {
+            get
+            {
+                lock (sync)
+                {
+                    Update();
+                    return eeprom;
+                }
+            }
+        }
+
+        /// <summary>
+        /// Возможности в отчёте о состоянии, как STATUS_CAPS_VALUE
+        /// </summary>
+        public LoaderCapabilities Capabilities
+        {
+            get
+            {
+                LoaderCapabilities caps = 0;
+                if (CanEraseEeprom) caps |= LoaderCapabilities.EraseEeprom;
+                if (CanReadFlash) caps |= LoaderCapabilities.ReadFlash;
+                if (CanLeaveLoader) caps |= LoaderCapabilities.LeaveLoader;
+                if (CanCheckData) caps |= LoaderCapabilities.CheckData;
+                if (CanSetAddress) caps |= LoaderCapabilities.SetAddress | LoaderCapabilities.ErasePage;
+                if (CanSupportHub) caps |= LoaderCapabilities.FillPart;
+                return caps;
+            }
+        }
+
+        private bool CanSetAddress
+        {
+            get { return CanCheckData || CanSupportHub; }
+        }
+
+        public string DevicePath
+        {
+            get { return path; }
+        }
+
+        public bool IsPresent()
+        {
+            lock (sync)
+            {
+                Update();
+                return connected;
+            }
+        }
+
+        public ILoaderTransport Open()
+        {
+            lock (sync)
+            {
+                if (!connected) throw new IOException("device disconnected");
+            }
+            return new Transport(this);
+        }
+
+        /// <summary>
+        /// Подключает устройство снова, как после сброса в загрузчик
+        /// </summary>
+        public void Reconnect()
+        {
+            lock (sync)
+            {
+                clock.Reset();
+                clock.Start();
+                offset = 0;
+                currentAddress = 0;
+                cmd = 0;
+                statusRequested = false;
+                pending = false;
+                busyUntil = 0;
+                setupTicks = NOT_SEEN;
+                for (int i = 0; i < pageBuffer.Length; i++) pageBuffer[i] = 0xff;
+                connected = true;
+            }
+        }
+
+        public void ResetStatistics()
+        {
+            lock (sync)
+            {
+                BytesOnWire = 0;
+                SetReports = 0;
+                GetReports = 0;
+                PageWrites = 0;
+                PageErases = 0;
+                Stalls = 0;
+                Timeouts = 0;
+            }
+        }
+
+        private double Now
+        {
+            get { return clock.Elapsed.TotalMilliseconds; }
+        }
+
+        /// <summary>
+        /// Выполняет защёлкнутую команду, если её время подошло
+        /// </summary>
+        private void Update()
+        {
+            if (pending && Now >= commitAt) Commit();
+        }
+
+        /// <summary>
+        /// Проверяет, что устройство способно принять SETUP
+        /// </summary>
+        private void BeginTransfer()
+        {
+            Update();
+            if (!connected) throw new IOException("device disconnected");
+            if (Now < busyUntil)
+            {
+                Timeouts++;
+                BytesOnWire += TOKEN_BYTES + CHUNK + DATA_OVERHEAD;
+                throw new IOException("device does not respond");
+            }
+            if (setupTicks == NOT_SEEN) setupTicks = Ticks;
+            // SETUP stage
+            BytesOnWire += TOKEN_BYTES + CHUNK + DATA_OVERHEAD + HANDSHAKE_BYTES;
+        }
+
+        private int Ticks
+        {
+            get { return (int)(Now * TIMER0_TICK_RATE / 1000) & 0xffff; }
+        }
+
+        private void SetFeature(byte[] report)
+        {
+            lock (sync)
+            {
+                BeginTransfer();
+                // usbFunctionSetup(): SET_REPORT
+                offset = 0;
+                for (int pos = 0; pos < LOADER_REPORT_SIZE; pos += CHUNK)
+                {
+                    int len = Math.Min(CHUNK, LOADER_REPORT_SIZE - pos);
+                    BytesOnWire += TOKEN_BYTES + len + DATA_OVERHEAD + HANDSHAKE_BYTES;
+                    byte[] chunk = new byte[len];
+                    Array.Copy(report, 1 + pos, chunk, 0, len);
+                    int result = FunctionWrite(chunk, len);
+                    if (result == 0xff)
+                    {
+                        Stalls++;
+                        throw new IOException("STALL");
+                    }
+                    if (result == 1) break;
+                }
+                // Status stage
+                BytesOnWire += TOKEN_BYTES + DATA_OVERHEAD + HANDSHAKE_BYTES;
+                SetReports++;
+            }
+        }
+
+        /// <summary>
+        /// usbFunctionWrite()
+        /// </summary>
+        /// <returns>0 - жду ещё, 1 - отчёт принят, 0xff - STALL</returns>
+        private int FunctionWrite(byte[] data, int len)
+        {
+            int pos = 0;
+            offset += len;
+            if (offset == len)
+            {
+                if (cmd != 0) return 0xff;
+                cmd = data[REPORT_COMMAND];
+
+                if (CanCheckData)
+                {
+                    crc = 0xffff;
+                    sign = (ushort)(data[REPORT_CRC] | (data[REPORT_CRC + 1] << 8));
+                    if (((data[REPORT_CMD_CHECK] + cmd) & 0xff) != 0xff)
+                    {
+                        cmd = 0;
+                        return 0xff;
+                    }
+                }
+
+                if ((cmd & DO_RESET_ADDRESS) != 0) currentAddress = 0;
+
+                pos += REPORT_DATA;
+                len -= REPORT_DATA;
+
+                if (CanSetAddress && (cmd & DO_SET_ADDRESS) != 0)
+                {
+                    currentAddress = data[pos] | (data[pos + 1] << 8);
+                    ClearPageBuffer();
+                }
+            }
+
+            if (CanCheckData)
+            {
+                crc = Crc16Table.Update(crc, data, pos, len);
+            }
+
+            if ((cmd & DO_FILL_FLASH) != 0 && (!CanSupportHub || (cmd & DO_FILL_PART) == 0 || offset <= 8))
+            {
+                for (; len > 0; pos += 2, len -= 2)
+                    WriteWord(data[pos] | (data[pos + 1] << 8));
+            }
+            if (offset == LOADER_REPORT_SIZE)
+            {
+                if (CanCheckData && crc != sign)
+                {
+                    cmd = 0;
+                    return 0xff;
+                }
+                if (CanReportStatus && cmd == 0) statusRequested = true;
+                // delay = 10
+                pending = true;
+                commitAt = Now + CommitDelayMs;
+                return 1;
+            }
+            return 0;
+        }
+
+        private void WriteWord(int word)
+        {
+            int addr = currentAddress;
+            if (addr == APP_RESET_ADDR)
+            {
+                word = vectors[0] + APP_RESET_SHIFT;
+            }
+            else if (addr == APP_PCINT_ADDR)
+            {
+                word = vectors[1] + APP_PCINT_SHIFT;
+            }
+            else if (addr == RESET_ADDR)
+            {
+                vectors[0] = word;
+                word = LOADER_VECTOR;
+            }
+            else if (addr == PCINT_ADDR)
+            {
+                vectors[1] = word;
+                word = LOADER_VECTOR;
+            }
+            // boot_page_fill() uses only the word index within the page
+            int index = currentAddress & (SPM_PAGESIZE - 2);
+            pageBuffer[index] = (byte)word;
+            pageBuffer[index + 1] = (byte)(word >> 8);
+            currentAddress = (currentAddress + 2) & 0xffff;
+        }
+
+        private void ClearPageBuffer()
+        {
+            for (int i = 0; i < pageBuffer.Length; i++) pageBuffer[i] = 0xff;
+        }
+
+        /// <summary>
+        /// Главный цикл: выполнение команды по истечении delay
+        /// </summary>
+        private void Commit()
+        {
+            pending = false;
+            double busy = 0;
+            if ((cmd & DO_ERASE_FLASH) != 0)
+            {
+                if (CanSetAddress && (cmd & DO_SET_ADDRESS) != 0)
+                {
+                    if (currentAddress < BOOTLOADER_ADDRESS) busy += ErasePage(currentAddress);
+                }
+                else
+                {
+                    for (int addr = BOOTLOADER_ADDRESS - SPM_PAGESIZE; addr >= 0; addr -= SPM_PAGESIZE)
+                        busy += ErasePage(addr);
+                    if ((cmd & DO_WRITE_FLASH) == 0)
+                    {
+                        // writeInitialPage()
+                        while (currentAddress < SPM_PAGESIZE) WriteWord(0xffff);
+                        busy += WritePage();
+                    }
+                }
+            }
+            if ((cmd & DO_WRITE_FLASH) != 0)
+            {
+                busy += WritePage();
+            }
+            if (CanEraseEeprom && (cmd & DO_ERASE_EEPROM) != 0)
+            {
+                for (int j = 0; j < E2END; j++) eeprom[j] = 0xff;
+                busy += E2END * EepromWriteMs;
+            }
+            if (CanLeaveLoader && (cmd & DO_LEAVE_BOOTLOADER) != 0)
+            {
+                connected = false;
+            }
+            cmd = 0;
+            busyUntil = commitAt + busy;
+        }
+
+        private double ErasePage(int address)
+        {
+            int page = address & (FLASH_SIZE - SPM_PAGESIZE);
+            for (int i = 0; i < SPM_PAGESIZE; i++) flash[page + i] = 0xff;
+            PageErases++;
+            return PageEraseMs;
+        }
+
+        private double WritePage()
+        {
+            if (currentAddress > BOOTLOADER_ADDRESS) return 0;
+            int page = (currentAddress - SPM_PAGESIZE) & (FLASH_SIZE - SPM_PAGESIZE);
+            // Flash cells can only go from 1 to 0 without erase
+            for (int i = 0; i < SPM_PAGESIZE; i++) flash[page + i] &= pageBuffer[i];
+            // Hardware clears the page buffer after write
+            ClearPageBuffer();
+            PageWrites++;
+            return PageWriteMs;
+        }
+
+        private void GetFeature(byte[] report)
+        {
+            lock (sync)
+            {
+                BeginTransfer();
+                if (!CanReadFlash && !CanReportStatus)
+                {
+                    // usbFunctionSetup() returns 0 for GET_REPORT
+                    Stalls++;
+                    throw new IOException("STALL");
+                }
+                exchangeReport[REPORT_COMMAND] = 0;
+                if (statusRequested)
+                {
+                    statusRequested = false;
+                    ReadStatus();
+                }
+                else if (CanReadFlash)
+                {
+                    for (int i = 0; i < SPM_PAGESIZE; i++)
+                    {
+                        exchangeReport[REPORT_DATA + i] = flash[currentAddress & (FLASH_SIZE - 1)];
+                        currentAddress = (currentAddress + 1) & 0xffff;
+                    }
+                }
+                if (CanCheckData)
+                {
+                    ushort value = Loader.Crc16(exchangeReport, REPORT_DATA, SPM_PAGESIZE);
+                    exchangeReport[REPORT_CRC] = (byte)value;
+                    exchangeReport[REPORT_CRC + 1] = (byte)(value >> 8);
+                }
+                report[0] = 0;
+                Array.Copy(exchangeReport, 0, report, 1, LOADER_REPORT_SIZE);
+                for (int pos = 0; pos < LOADER_REPORT_SIZE; pos += CHUNK)
+                    BytesOnWire += TOKEN_BYTES + Math.Min(CHUNK, LOADER_REPORT_SIZE - pos) + DATA_OVERHEAD + HANDSHAKE_BYTES;
+                BytesOnWire += TOKEN_BYTES + DATA_OVERHEAD + HANDSHAKE_BYTES;
+                GetReports++;
+            }
+        }
+
+        private void ReadStatus()
+        {
+            int ptr = REPORT_DATA;
+            exchangeReport[ptr + 0] = (byte)'S';
+            exchangeReport[ptr + 1] = (byte)Capabilities;
+            PutWord(ptr + 2, currentAddress);
+            PutWord(ptr + 4, setupTicks);
+            PutWord(ptr + 6, TIMER0_TICK_RATE);
+            PutWord(ptr + 8, Ticks);
+            PutWord(ptr + 10, STATUS_MAGIC);
+        }
+
+        private void PutWord(int pos, int value)
+        {
+            exchangeReport[pos] = (byte)value;
+            exchangeReport[pos + 1] = (byte)(value >> 8);
+        }
+
+        public override string ToString()
+        {
+            lock (sync) Update();
+            return string.Format("{0}: {1} bytes on wire, {2} set, {3} get, {4} page writes, {5} page erases, {6} stalls, {7} timeouts",
+                path, BytesOnWire, SetReports, GetReports, PageWrites, PageErases, Stalls, Timeouts);
+        }
+
+        class Transport : ILoaderTransport
+        {
+            EmulatedDevice device;
+
+            public Transport(EmulatedDevice device)
+            {
+                this.device = device;
+            }
+
+            private EmulatedDevice Device
+            {
+                get
+                {
+                    if (device == null) throw new ObjectDisposedException("EmulatedDevice");
+                    return device;
+                }
+            }
+
+            public void SetFeature(byte[] report)
+            {
+                Device.SetFeature(report);
+            }
+
+            public void GetFeature(byte[] report)
+            {
+                Device.GetFeature(report);
+            }
+
+            public void Dispose()
+            {
+                device = null;
+            }
+        }
+    }
+}
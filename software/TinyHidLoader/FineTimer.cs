@@ -0,0 +1,70 @@
+﻿using System;
+using System.Collections.Generic;
+using System.Runtime.InteropServices;
+using System.Text;
+
+namespace DeliSu.TinyHidLoader
+{
+    /// <summary>
+    /// Шаг системного таймера 1 мс на время коротких пауз
+    /// </summary>
+    /// <remarks>
+    /// В Windows Thread.Sleep и Monitor.Wait по умолчанию отсчитывают время квантами по 15,6 мс,
+    /// а паузы между страницами - единицы миллисекунд. Пока хоть одна пауза идёт, таймер
+    /// переводится на 1 мс. В остальных системах ничего не делает.
+    /// </remarks>
+    internal static class FineTimer
+    {
+        const uint RESOLUTION = 1;
+
+        [DllImport("winmm.dll")]
+        static extern uint timeBeginPeriod(uint period);
+
+        [DllImport("winmm.dll")]
+        static extern uint timeEndPeriod(uint period);
+
+        static readonly object sync = new object();
+        static readonly bool supported = Environment.OSVersion.Platform == PlatformID.Win32NT;
+        static int users;
+        static bool failed;
+
+        /// <summary>
+        /// Включает таймер 1 мс, каждому вызову соответствует свой End
+        /// </summary>
+        public static void Begin()
+        {
+            if (!supported) return;
+            lock (sync)
+            {
+                if (users++ == 0) Call(true);
+            }
+        }
+
+        public static void End()
+        {
+            if (!supported) return;
+            lock (sync)
+            {
+                if (--users == 0) Call(false);
+            }
+        }
+
+        static void Call(bool begin)
+        {
+            if (failed) return;
+            try
+            {
+                if (begin) timeBeginPeriod(RESOLUTION);
+                else timeEndPeriod(RESOLUTION);
+            }
+            catch (DllNotFoundException)
+            {
+                failed = true;
+            }
+            catch (EntryPointNotFoundException)
+            {
+                failed = true;
+            }
+        }
+    }
+}
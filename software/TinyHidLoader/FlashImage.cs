@@ -0,0 +1,205 @@
+﻿using System;
+using System.Collections.Generic;
+using System.Text;
+
+namespace DeliSu.TinyHidLoader
+{
+    /// <summary>
+    /// Образ FLASH, разбитый на страницы
+    /// </summary>
+    /// <remarks>
+    /// Помнит, на какие страницы попали данные, и кэширует crc16 страниц.
+    /// Незаписанные байты равны 0xff, как в очищенной FLASH.
+    /// </remarks>
+    public class FlashImage
+    {
+        readonly byte[] data;
+        readonly int pageSize;
+        readonly uint[] used;
+        readonly ushort[] crc;
+        readonly uint[] crcValid;
+
+        /// <summary>
+        /// Содержимое образа. После изменения напрямую нужно вызвать Invalidate
+        /// </summary>
+        public byte[] Data
+        {
+            get { return data; }
+        }
+
+        public int Size
+        {
+            get { return data.Length; }
+        }
+
+        public int PageSize
+        {
+            get { return pageSize; }
+        }
+
+        public int PageCount
+        {
+            get { return (data.Length + pageSize - 1) / pageSize; }
+        }
+
+        public FlashImage(int size)
+            : this(size, Loader.PAGESIZE)
+        {
+        }
+
+        public FlashImage(int size, int pageSize)
+        {
+            this.pageSize = pageSize;
+            data = new byte[size];
+            for (int i = 0; i < data.Length; i++) data[i] = 0xff;
+            int pages = PageCount;
+            used = new uint[(pages + 31) / 32];
+            crc = new ushort[pages];
+            crcValid = new uint[(pages + 31) / 32];
+        }
+
+        /// <summary>
+        /// Строит образ из HEX файла
+        /// </summary>
+        /// <param name="hex">HEX файл</param>
+        /// <param name="size">Размер образа, данные за его пределами отбрасываются</param>
+        public static FlashImage FromHex(HexFile hex, int size)
+        {
+            FlashImage image = new FlashImage(size);
+            image.Load(hex, 0);
+            return image;
+        }
+
+        /// <summary>
+        /// Копирует данные HEX файла в образ
+        /// </summary>
+        /// <param name="hex">HEX файл</param>
+        /// <param name="offset">Смещение, прибавляемое к адресам файла</param>
+        public void Load(HexFile hex, long offset)
+        {
+            foreach (HexFile.HexChunk chunk in hex.Chunks)
+            {
+                long start = chunk.Offset + offset;
+                long from = Math.Max(start, 0);
+                long to = Math.Min(start + chunk.Data.Length, data.Length);
+                if (from >= to) continue;
+                Write((int)from, chunk.Data, (int)(from - start), (int)(to - from));
+            }
+        }
+
+        /// <summary>
+        /// Записывает данные в образ
+        /// </summary>
+        /// <param name="address">Адрес в образе</param>
+        /// <param name="buffer">Данные</param>
+        /// <param name="offset">Смещение данных</param>
+        /// <param name="count">Количество байт</param>
+        public void Write(int address, byte[] buffer, int offset, int count)
+        {
+            if (count <= 0) return;
+            Array.Copy(buffer, offset, data, address, count);
+            int last = (address + count - 1) / pageSize;
+            for (int page = address / pageSize; page <= last; page++)
+            {
+                used[page >> 5] |= 1u << (page & 31);
+                crcValid[page >> 5] &= ~(1u << (page & 31));
+            }
+        }
+
+        /// <summary>
+        /// Сбрасывает кэш crc16 после изменения Data напрямую
+        /// </summary>
+        public void Invalidate()
+        {
+            Array.Clear(crcValid, 0, crcValid.Length);
+        }
+
+        /// <summary>
+        /// Страница содержит данные из HEX файла или записанные через Write
+        /// </summary>
+        public bool IsPageUsed(int page)
+        {
+            return (used[page >> 5] & (1u << (page & 31))) != 0;
+        }
+
+        /// <summary>
+        /// Номера страниц с данными, по возрастанию
+        /// </summary>
+        public IEnumerable<int> UsedPages
+        {
+            get
+            {
+                for (int page = 0; page < PageCount; page++)
+                    if (IsPageUsed(page)) yield return page;
+            }
+        }
+
+        public int UsedPageCount
+        {
+            get
+            {
+                int count = 0;
+                for (int page = 0; page < PageCount; page++)
+                    if (IsPageUsed(page)) count++;
+                return count;
+            }
+        }
+
+        /// <summary>
+        /// Адрес первой страницы с данными, или Size, если данных нет
+        /// </summary>
+        public int Start
+        {
+            get
+            {
+                for (int page = 0; page < PageCount; page++)
+                    if (IsPageUsed(page)) return page * pageSize;
+                return data.Length;
+            }
+        }
+
+        /// <summary>
+        /// Адрес за последней страницей с данными, или 0, если данных нет
+        /// </summary>
+        public int End
+        {
+            get
+            {
+                for (int page = PageCount - 1; page >= 0; page--)
+                    if (IsPageUsed(page)) return Math.Min((page + 1) * pageSize, data.Length);
+                return 0;
+            }
+        }
+
+        /// <summary>
+        /// crc16 всех страниц
+        /// </summary>
+        public ushort[] PageCrcs()
+        {
+            ushort[] result = new ushort[PageCount];
+            for (int page = 0; page < result.Length; page++) result[page] = PageCrc(page);
+            return result;
+        }
+
+        /// <summary>
+        /// crc16 страницы, как его считает загрузчик
+        /// </summary>
+        /// <remarks>
+        /// Последняя неполная страница дополняется 0xff
+        /// </remarks>
+        public ushort PageCrc(int page)
+        {
+            uint bit = 1u << (page & 31);
+            if ((crcValid[page >> 5] & bit) == 0)
+            {
+                int address = page * pageSize;
+                int count = Math.Min(pageSize, data.Length - address);
+                ushort value = Loader.Crc16(data, address, count);
+                for (int i = count; i < pageSize; i++) value = Loader.Crc16Update(value, 0xff);
+                crc[page] = value;
+                crcValid[page >> 5] |= bit;
+            }
+            return crc[page];
+        }
+    }
+}
@@ -0,0 +1,224 @@
+﻿using System;
+using System.Collections.Generic;
+using System.IO;
+using System.Text;
+
+namespace DeliSu.TinyHidLoader
+{
+    /// <summary>
+    /// Готовая последовательность подписанных отчётов для записи всей FLASH
+    /// </summary>
+    /// <remarks>
+    /// Строится один раз из образа и затем воспроизводится на любом количестве устройств:
+    /// на устройство остаётся только копирование отчётов, без разбора HEX и подсчёта crc16.
+    /// В памяти план хранится в том же виде, что и в файле (little-endian):
+    /// <code>
+    /// 0   uint  "TLFP"
+    /// 4   int   версия
+    /// 8   int   размер страницы
+    /// 12  int   LOADERSTART
+    /// 16  int   размер отчёта, с номером отчёта
+    /// 20  int   количество отчётов (= страниц)
+    /// 24  int   смещение отчётов от начала файла, кратно 8
+    /// 28  ushort[количество] crc16 страниц
+    ///     byte[количество * размер отчёта] отчёты
+    /// </code>
+    /// Отчёты лежат по фиксированным смещениям, так что файл можно отобразить в память;
+    /// в .NET 3.5 отображения нет, и Load читает файл одним блоком.
+    /// </remarks>
+    public class FlashPlan
+    {
+        const uint MAGIC = 0x50464c54; // "TLFP"
+        const int VERSION = 1;
+        const int HEADER_SIZE = 28;
+        const int ALIGN = 8;
+
+        readonly byte[] plan;
+        readonly int reportCount;
+        readonly int reportsOffset;
+
+        private FlashPlan(byte[] plan)
+        {
+            this.plan = plan;
+            if (plan.Length < HEADER_SIZE || ReadInt(0) != (int)MAGIC)
+                throw new FormatException("not a flash plan");
+            if (ReadInt(4) != VERSION)
+                throw new FormatException("unsupported flash plan version " + ReadInt(4));
+            if (ReadInt(8) != Loader.PAGESIZE || ReadInt(12) != Loader.LOADERSTART || ReadInt(16) != Loader.REPORT_SIZE)
+                throw new FormatException("flash plan is built for another loader");
+            reportCount = ReadInt(20);
+            reportsOffset = ReadInt(24);
+            if (reportCount != PageCountFor() || reportsOffset < HEADER_SIZE + reportCount * 2 ||
+                plan.Length != reportsOffset + reportCount * Loader.REPORT_SIZE)
+                throw new FormatException("flash plan is truncated");
+        }
+
+        private static int PageCountFor()
+        {
+            return (Loader.LOADERSTART + Loader.PAGESIZE - 1) / Loader.PAGESIZE;
+        }
+
+        /// <summary>
+        /// Количество отчётов, по одному на страницу
+        /// </summary>
+        public int ReportCount
+        {
+            get { return reportCount; }
+        }
+
+        /// <summary>
+        /// Размер записываемой области
+        /// </summary>
+        public int Size
+        {
+            get { return Loader.LOADERSTART; }
+        }
+
+        /// <summary>
+        /// Строит план по образу
+        /// </summary>
+        /// <remarks>
+        /// Байты от LOADERSTART и дальше заменяются 0xff, их место занимают векторы приложения.
+        /// </remarks>
+        /// <param name="programm">Образ прошивки, не меньше LOADERSTART от смещения</param>
+        /// <param name="offset">Смещение в массиве образа</param>
+        public static FlashPlan Create(byte[] programm, int offset)
+        {
+            if (programm.Length - offset < Loader.LOADERSTART)
+                throw new ArgumentException("image does not cover application flash", "programm");
+
+            int count = PageCountFor();
+            int reportsOffset = (HEADER_SIZE + count * 2 + ALIGN - 1) / ALIGN * ALIGN;
+            byte[] plan = new byte[reportsOffset + count * Loader.REPORT_SIZE];
+            WriteInt(plan, 0, (int)MAGIC);
+            WriteInt(plan, 4, VERSION);
+            WriteInt(plan, 8, Loader.PAGESIZE);
+            WriteInt(plan, 12, Loader.LOADERSTART);
+            WriteInt(plan, 16, Loader.REPORT_SIZE);
+            WriteInt(plan, 20, count);
+            WriteInt(plan, 24, reportsOffset);
+
+            for (int page = 0; page < count; page++)
+            {
+                int report = reportsOffset + page * Loader.REPORT_SIZE;
+                LoaderCommand command = LoaderCommand.WriteFlash | LoaderCommand.FillFlash;
+                if (page == 0) command |= LoaderCommand.EraseFlash | LoaderCommand.ResetAddress;
+                plan[report + Loader.REPORT_COMMAND] = (byte)command;
+
+                int address = page * Loader.PAGESIZE;
+                int rest = Math.Min(Loader.PAGESIZE, Loader.LOADERSTART - address);
+                Buffer.BlockCopy(programm, offset + address, plan, report + Loader.REPORT_DATA, rest);
+                for (int i = rest; i < Loader.PAGESIZE; i++) plan[report + Loader.REPORT_DATA + i] = 0xff;
+
+                plan[report + Loader.REPORT_CMD_CHECK] = (byte)~(byte)command;
+                ushort crc = Loader.Crc16(plan, report + Loader.REPORT_DATA, Loader.PAGESIZE);
+                plan[report + Loader.REPORT_CRC] = (byte)crc;
+                plan[report + Loader.REPORT_CRC + 1] = (byte)(crc >> 8);
+                plan[HEADER_SIZE + page * 2] = (byte)crc;
+                plan[HEADER_SIZE + page * 2 + 1] = (byte)(crc >> 8);
+            }
+            return new FlashPlan(plan);
+        }
+
+        /// <summary>
+        /// Строит план по образу
+        /// </summary>
+        public static FlashPlan Create(FlashImage image)
+        {
+            return Create(image.Data, 0);
+        }
+
+        /// <summary>
+        /// Строит план по HEX файлу, данные за LOADERSTART отбрасываются
+        /// </summary>
+        public static FlashPlan Create(HexFile hex)
+        {
+            return Create(FlashImage.FromHex(hex, Loader.LOADERSTART));
+        }
+
+        public static FlashPlan Load(string filename)
+        {
+            using (FileStream stream = File.OpenRead(filename)) return Load(stream);
+        }
+
+        /// <summary>
+        /// Читает план и проверяет подписи всех отчётов
+        /// </summary>
+        public static FlashPlan Load(Stream stream)
+        {
+            MemoryStream data = new MemoryStream();
+            byte[] block = new byte[4096];
+            int readed;
+            while ((readed = stream.Read(block, 0, block.Length)) > 0) data.Write(block, 0, readed);
+            FlashPlan plan = new FlashPlan(data.ToArray());
+            plan.Validate();
+            return plan;
+        }
+
+        private void Validate()
+        {
+            for (int page = 0; page < reportCount; page++)
+            {
+                int report = reportsOffset + page * Loader.REPORT_SIZE;
+                ushort crc = Loader.Crc16(plan, report + Loader.REPORT_DATA, Loader.PAGESIZE);
+                if (plan[report] != 0 || crc != ReadCrc(report + Loader.REPORT_CRC) || crc != PageCrc(page) ||
+                    (byte)(plan[report + Loader.REPORT_COMMAND] + plan[report + Loader.REPORT_CMD_CHECK]) != 0xff)
+                    throw new FormatException("flash plan is corrupted at page " + page);
+            }
+        }
+
+        public void Save(string filename)
+        {
+            using (FileStream stream = File.Create(filename)) Save(stream);
+        }
+
+        public void Save(Stream stream)
+        {
+            stream.Write(plan, 0, plan.Length);
+        }
+
+        /// <summary>
+        /// crc16 страницы, как его считает загрузчик
+        /// </summary>
+        public ushort PageCrc(int page)
+        {
+            return ReadCrc(HEADER_SIZE + page * 2);
+        }
+
+        /// <summary>
+        /// crc16 всех страниц, для кэша частичной записи
+        /// </summary>
+        public ushort[] PageCrcs()
+        {
+            ushort[] result = new ushort[reportCount];
+            for (int page = 0; page < result.Length; page++) result[page] = PageCrc(page);
+            return result;
+        }
+
+        /// <summary>
+        /// Копирует подписанный отчёт в буфер отправки
+        /// </summary>
+        internal void CopyReport(int index, byte[] report)
+        {
+            Buffer.BlockCopy(plan, reportsOffset + index * Loader.REPORT_SIZE, report, 0, Loader.REPORT_SIZE);
+        }
+
+        private ushort ReadCrc(int pos)
+        {
+            return (ushort)(plan[pos] | (plan[pos + 1] << 8));
+        }
+
+        private int ReadInt(int pos)
+        {
+            return plan[pos] | (plan[pos + 1] << 8) | (plan[pos + 2] << 16) | (plan[pos + 3] << 24);
+        }
+
+        private static void WriteInt(byte[] buffer, int pos, int value)
+        {
+            buffer[pos] = (byte)value;
+            buffer[pos + 1] = (byte)(value >> 8);
+            buffer[pos + 2] = (byte)(value >> 16);
+            buffer[pos + 3] = (byte)(value >> 24);
+        }
+    }
+}
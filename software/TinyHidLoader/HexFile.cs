@@ -1,6 +1,5 @@
 ﻿using System;
 using System.Collections.Generic;
-using System.Globalization;
 using System.IO;
 using System.Text;
 
@@ -45,6 +44,53 @@ namespace DeliSu
             }
         }
 
+        /// <summary>
+        /// Непрерывный участок данных, собираемый при чтении
+        /// </summary>
+        private class HexRun
+        {
+            public long Offset;
+            public byte[] Data;
+            public int Length;
+            // Порядок появления в файле, поздние данные перекрывают ранние
+            public int Sequence;
+
+            public HexRun(long offset, int capacity, int sequence)
+            {
+                Offset = offset;
+                Data = new byte[capacity];
+                Sequence = sequence;
+            }
+
+            public HexRun(long offset, byte[] data, int sequence)
+            {
+                Offset = offset;
+                Data = data;
+                Length = data.Length;
+                Sequence = sequence;
+            }
+
+            public long End
+            {
+                get { return Offset + Length; }
+            }
+
+            public void Append(byte[] data, int count)
+            {
+                if (Length + count > Data.Length)
+                {
+                    byte[] grown = new byte[Math.Max(Data.Length * 2, Length + count)];
+                    Array.Copy(Data, grown, Length);
+                    Data = grown;
+                }
+                Array.Copy(data, 0, Data, Length, count);
+                Length += count;
+            }
+        }
+
+        const int MIN_CAPACITY = 256;
+        const int MAX_INITIAL_CAPACITY = 1 << 20;
+
         public List<HexChunk> Chunks { get; set; }
 
         public HexFile(string filename)
@@ -80,7 +126,7 @@ namespace DeliSu
                 long result = 0;
                 foreach (var chunk in Chunks)
                 {
-                    result = Math.Max(result, chunk.Data.Length);
+                    result = Math.Max(result, chunk.Offset + chunk.Data.Length);
                 }
                 return result;
             }
@@ -91,29 +137,6 @@ namespace DeliSu
             get { return End - Offset; }
         }
 
-        private void AppendData(long offset, byte[] data)
-        {
-            HexChunk nchunk = new HexChunk(offset, data);
-            if (Chunks.Count > 0)
-            {
-                HexChunk lchunk = Chunks[Chunks.Count - 1];
-                if (lchunk.Intersect(nchunk))
-                {
-                    lchunk.Combine(nchunk);
-                    return;
-                }
-                for (int i = 0; i < Chunks.Count; i++)
-                {
-                    if (Chunks[i].Intersect(nchunk))
-                    {
-                        Chunks[i].Combine(nchunk);
-                        return;
-                    }
-                }
-            }
-            Chunks.Add(nchunk);
-        }
-
         public void Fill(byte[] buffer)
         {
             Fill(buffer, 0);
@@ -123,43 +146,43 @@ namespace DeliSu
         {
             foreach (HexFile.HexChunk c in Chunks)
             {
-                long pos = c.Offset + offset;
-                for (int i = 0; i < c.Data.Length; i++)
-                {
-                    buffer[pos++] = c.Data[i];
-                }
+                Array.Copy(c.Data, 0, buffer, c.Offset + offset, c.Data.Length);
             }
         }
 
         public void Open(string filename)
         {
-            long currentOffset = 0;
-            int ln = 0;
-            bool hasEnd = false;
-            foreach (string line in File.ReadAllLines(filename))
+            using (FileStream stream = new FileStream(filename, FileMode.Open, FileAccess.Read, FileShare.Read))
             {
-                if (string.IsNullOrEmpty(line)) continue;
-                if (hasEnd) throw new FormatException("Dataline after end at " + ln + ": " + line);
-
-                if (line.Length < 11) throw new FormatException("Invalid line, too short at " + ln + ": " + line);
-                int length = int.Parse(line.Substring(1, 2), NumberStyles.HexNumber);
-                if (line.Trim().Length != 11 + length * 2) throw new FormatException("Invalid line, invalid length at " + ln + ": " + line);
-
-                int address = int.Parse(line.Substring(3, 4), NumberStyles.HexNumber);
-                int type = int.Parse(line.Substring(7, 2), NumberStyles.HexNumber);
-                int summ = length + (address & 0xff) + (address >> 8 & 0xff) + type;
-
+                Open(stream);
+            }
+        }
 
-                byte[] data = new byte[length];
+        /// <summary>
+        /// Читает данные из потока Intel HEX и добавляет их к уже имеющимся
+        /// </summary>
+        /// <remarks>
+        /// Подряд идущие записи собираются в непрерывные участки, которые в конце
+        /// сортируются и сливаются за один проход. Более поздние данные перекрывают ранние.
+        /// </remarks>
+        public void Open(Stream stream)
+        {
+            List<HexRun> runs = new List<HexRun>();
+            foreach (HexChunk chunk in Chunks)
+                runs.Add(new HexRun(chunk.Offset, chunk.Data, runs.Count));
 
-                for (int i = 0; i < length; i++)
-                {
-                    data[i] = byte.Parse(line.Substring(9 + i * 2, 2), NumberStyles.HexNumber);
-                    summ += data[i];
-                }
-                summ += byte.Parse(line.Substring(9 + length * 2, 2), NumberStyles.HexNumber);
-                if ((summ & 0xff) != 0) throw new FormatException("Invalid line, invalid checksum at " + ln + ": " + line);
+            // Data bytes take at most half of the file, so first run is sized to hold them all
+            int capacity = stream.CanSeek ? (int)Math.Min(stream.Length / 2, MAX_INITIAL_CAPACITY) : MIN_CAPACITY;
+            HexReader reader = new HexReader(stream);
+            HexRun run = null;
+            long currentOffset = 0;
+            bool hasEnd = false;
+            while (reader.Read())
+            {
+                if (hasEnd) throw new FormatException("Dataline after end at " + reader.LineNumber);
 
+                byte[] data = reader.Data;
+                int type = reader.Type;
                 if (type == 1)
                 {
                     hasEnd = true;
@@ -174,7 +197,14 @@ namespace DeliSu
                 }
                 else if (type == 0)
                 {
-                    AppendData(currentOffset + address, data);
+                    long offset = currentOffset + reader.Address;
+                    if (run == null || offset != run.End)
+                    {
+                        run = new HexRun(offset, Math.Max(capacity, MIN_CAPACITY), runs.Count);
+                        runs.Add(run);
+                        capacity = MIN_CAPACITY;
+                    }
+                    run.Append(data, reader.Length);
                 }
                 else if (type == 3)
                 {
@@ -182,15 +212,54 @@ namespace DeliSu
                 }
                 else
                 {
-                    throw new FormatException("Invalid directive " + type + " at " + ln);
+                    throw new FormatException("Invalid directive " + type + " at " + reader.LineNumber);
                 }
-
-                ln++;
             }
             if (!hasEnd)
             {
                 throw new FormatException("No file end directive found");
             }
+            Chunks = Merge(runs);
+        }
+
+        /// <summary>
+        /// Сливает пересекающиеся и соседние участки в упорядоченные по адресу блоки
+        /// </summary>
+        private static List<HexChunk> Merge(List<HexRun> runs)
+        {
+            runs.Sort(delegate(HexRun x, HexRun y)
+            {
+                if (x.Offset != y.Offset) return x.Offset.CompareTo(y.Offset);
+                return x.Sequence.CompareTo(y.Sequence);
+            });
+            List<HexChunk> result = new List<HexChunk>();
+            int i = 0;
+            while (i < runs.Count)
+            {
+                long start = runs[i].Offset;
+                long end = runs[i].End;
+                int j = i + 1;
+                while (j < runs.Count && runs[j].Offset <= end)
+                {
+                    end = Math.Max(end, runs[j].End);
+                    j++;
+                }
+                byte[] data = new byte[end - start];
+                if (j == i + 1)
+                {
+                    Array.Copy(runs[i].Data, 0, data, 0, runs[i].Length);
+                }
+                else
+                {
+                    List<HexRun> group = runs.GetRange(i, j - i);
+                    group.Sort(delegate(HexRun x, HexRun y) { return x.Sequence.CompareTo(y.Sequence); });
+                    foreach (HexRun r in group)
+                        Array.Copy(r.Data, 0, data, r.Offset - start, r.Length);
+                }
+                result.Add(new HexChunk(start, data));
+                i = j;
+            }
+            return result;
         }
 
         public void Write(string filename)
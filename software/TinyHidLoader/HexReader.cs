@@ -0,0 +1,151 @@
+﻿using System;
+using System.Collections.Generic;
+using System.IO;
+using System.Text;
+
+namespace DeliSu
+{
+    /// <summary>
+    /// Потоковое чтение записей Intel HEX
+    /// </summary>
+    /// <remarks>
+    /// Читает поток блоками и разбирает цифры по таблице, без выделения памяти на каждую строку.
+    /// Данные записи действительны до следующего вызова Read.
+    /// </remarks>
+    public class HexReader
+    {
+        const int BUFFER_SIZE = 4096;
+        // ':' + length + address + type + 255 bytes + checksum
+        const int MAX_LINE = 1 + 2 + 4 + 2 + 255 * 2 + 2;
+
+        static readonly sbyte[] digits = CreateDigits();
+
+        readonly Stream stream;
+        readonly byte[] buffer = new byte[BUFFER_SIZE];
+        int bufferPos;
+        int bufferLength;
+        readonly byte[] line = new byte[MAX_LINE];
+        int lineLength;
+        readonly byte[] data = new byte[255];
+
+        /// <summary>
+        /// Номер записи, считая с 0, без пустых строк
+        /// </summary>
+        public int LineNumber { get; private set; }
+
+        public int Type { get; private set; }
+        public int Address { get; private set; }
+        public int Length { get; private set; }
+
+        /// <summary>
+        /// Данные записи, используются первые Length байт
+        /// </summary>
+        public byte[] Data
+        {
+            get { return data; }
+        }
+
+        public HexReader(Stream stream)
+        {
+            this.stream = stream;
+            LineNumber = -1;
+        }
+
+        static sbyte[] CreateDigits()
+        {
+            sbyte[] result = new sbyte[256];
+            for (int i = 0; i < result.Length; i++) result[i] = -1;
+            for (int i = 0; i < 10; i++) result['0' + i] = (sbyte)i;
+            for (int i = 0; i < 6; i++)
+            {
+                result['A' + i] = (sbyte)(10 + i);
+                result['a' + i] = (sbyte)(10 + i);
+            }
+            return result;
+        }
+
+        /// <summary>
+        /// Читает следующую запись
+        /// </summary>
+        /// <returns>false, если поток закончился</returns>
+        public bool Read()
+        {
+            do
+            {
+                if (!ReadLine()) return false;
+            }
+            while (lineLength == 0);
+            LineNumber++;
+
+            if (lineLength < 11) throw Error("Invalid line, too short");
+            if (line[0] != ':') throw Error("Invalid line, no start code");
+            int length = ReadByte(1);
+            if (lineLength != 11 + length * 2) throw Error("Invalid line, invalid length");
+
+            int address = (ReadByte(3) << 8) | ReadByte(5);
+            int type = ReadByte(7);
+            int summ = length + (address & 0xff) + (address >> 8 & 0xff) + type;
+            for (int i = 0; i < length; i++)
+            {
+                data[i] = (byte)ReadByte(9 + i * 2);
+                summ += data[i];
+            }
+            summ += ReadByte(9 + length * 2);
+            if ((summ & 0xff) != 0) throw Error("Invalid line, invalid checksum");
+
+            Type = type;
+            Address = address;
+            Length = length;
+            return true;
+        }
+
+        private int ReadByte(int pos)
+        {
+            int hi = digits[line[pos]];
+            int lo = digits[line[pos + 1]];
+            if ((hi | lo) < 0) throw Error("Invalid line, invalid hex digit");
+            return (hi << 4) | lo;
+        }
+
+        /// <summary>
+        /// Копирует строку в буфер строки без пробелов по краям
+        /// </summary>
+        private bool ReadLine()
+        {
+            lineLength = 0;
+            bool any = false;
+            while (true)
+            {
+                if (bufferPos == bufferLength)
+                {
+                    bufferLength = stream.Read(buffer, 0, buffer.Length);
+                    bufferPos = 0;
+                    if (bufferLength == 0) break;
+                }
+                any = true;
+                byte b = buffer[bufferPos++];
+                if (b == '\n') break;
+                // Leading whitespace is skipped, trailing is cut below
+                if (lineLength == 0 && IsSpace(b)) continue;
+                if (lineLength == MAX_LINE)
+                {
+                    if (!IsSpace(b)) throw Error("Invalid line, too long");
+                    continue;
+                }
+                line[lineLength++] = b;
+            }
+            while (lineLength > 0 && IsSpace(line[lineLength - 1])) lineLength--;
+            return any;
+        }
+
+        private static bool IsSpace(byte b)
+        {
+            return b == '\r' || b == ' ' || b == '\t';
+        }
+
+        private FormatException Error(string message)
+        {
+            return new FormatException(message + " at " + LineNumber + ": " + Encoding.ASCII.GetString(line, 0, lineLength));
+        }
+    }
+}
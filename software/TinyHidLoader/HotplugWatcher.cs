@@ -0,0 +1,187 @@
+﻿using System;
+using System.Collections.Generic;
+using System.Runtime.InteropServices;
+using System.Text;
+using System.Threading;
+
+namespace DeliSu.TinyHidLoader
+{
+    /// <summary>
+    /// Ожидание подключения и отключения USB устройств
+    /// </summary>
+    /// <remarks>
+    /// В Linux слушает uevent ядра и udev через netlink и просыпается сразу, как появился
+    /// или пропал hidraw/usb узел. Подходит ли устройство (VID/PID/серийный номер), проверяет
+    /// вызывающий повторным поиском. Там, где netlink недоступен, ожидание сводится к опросу
+    /// каждые POLL_INTERVAL.
+    /// События накапливаются в сокете с момента создания, поэтому ничего не теряется между
+    /// поиском и следующим WaitForChange.
+    /// </remarks>
+    public class HotplugWatcher : IDisposable
+    {
+        const int POLL_INTERVAL = 50;
+
+        const int AF_NETLINK = 16;
+        const int SOCK_DGRAM = 2;
+        const int SOCK_CLOEXEC = 0x80000;
+        const int NETLINK_KOBJECT_UEVENT = 15;
+        // Kernel uevents and udev events (sent after rules have set up the node)
+        const uint UEVENT_GROUPS = 1 | 2;
+        const short POLLIN = 1;
+        const int MSG_DONTWAIT = 0x40;
+        const int EINTR = 4;
+
+        [StructLayout(LayoutKind.Sequential)]
+        struct SockaddrNl
+        {
+            public ushort Family;
+            public ushort Pad;
+            public uint Pid;
+            public uint Groups;
+        }
+
+        [StructLayout(LayoutKind.Sequential)]
+        struct PollFd
+        {
+            public int Fd;
+            public short Events;
+            public short Revents;
+        }
+
+        [DllImport("libc", EntryPoint = "socket", SetLastError = true)]
+        static extern int sys_socket(int domain, int type, int protocol);
+
+        [DllImport("libc", EntryPoint = "bind", SetLastError = true)]
+        static extern int sys_bind(int fd, ref SockaddrNl addr, int addrlen);
+
+        [DllImport("libc", EntryPoint = "poll", SetLastError = true)]
+        static extern int sys_poll(ref PollFd fds, uint nfds, int timeout);
+
+        [DllImport("libc", EntryPoint = "recv", SetLastError = true)]
+        static extern IntPtr sys_recv(int fd, byte[] buffer, UIntPtr len, int flags);
+
+        [DllImport("libc", EntryPoint = "close", SetLastError = true)]
+        static extern int sys_close(int fd);
+
+        readonly object sync = new object();
+        readonly byte[] message = new byte[8192];
+        int socket = -1;
+
+        /// <summary>
+        /// Слушает события USB, если система это позволяет
+        /// </summary>
+        public HotplugWatcher()
+            : this(true)
+        {
+        }
+
+        /// <param name="eventDriven">false - только опрос, для устройств не на шине USB</param>
+        public HotplugWatcher(bool eventDriven)
+        {
+            if (eventDriven && Environment.OSVersion.Platform == PlatformID.Unix)
+                socket = OpenUevents();
+        }
+
+        /// <summary>
+        /// Ожидание идёт по событиям системы, а не опросом
+        /// </summary>
+        public bool IsEventDriven
+        {
+            get { return socket >= 0; }
+        }
+
+        static int OpenUevents()
+        {
+            try
+            {
+                int fd = sys_socket(AF_NETLINK, SOCK_DGRAM | SOCK_CLOEXEC, NETLINK_KOBJECT_UEVENT);
+                if (fd < 0) return -1;
+                SockaddrNl addr = new SockaddrNl();
+                addr.Family = AF_NETLINK;
+                addr.Groups = UEVENT_GROUPS;
+                if (sys_bind(fd, ref addr, Marshal.SizeOf(typeof(SockaddrNl))) < 0)
+                {
+                    sys_close(fd);
+                    return -1;
+                }
+                return fd;
+            }
+            catch (DllNotFoundException)
+            {
+                return -1;
+            }
+            catch (EntryPointNotFoundException)
+            {
+                return -1;
+            }
+        }
+
+        /// <summary>
+        /// Ждёт подключения или отключения USB устройства
+        /// </summary>
+        /// <param name="timeout">Время ожидания, в миллисекундах</param>
+        /// <returns>true, если пора заново искать устройства; false по истечении времени</returns>
+        public bool WaitForChange(int timeout)
+        {
+            lock (sync)
+            {
+                if (socket < 0)
+                {
+                    Thread.Sleep(Math.Max(0, Math.Min(timeout, POLL_INTERVAL)));
+                    return true;
+                }
+
+                int deadline = Environment.TickCount + timeout;
+                while (true)
+                {
+                    int rest = Math.Max(0, deadline - Environment.TickCount);
+                    PollFd fd = new PollFd();
+                    fd.Fd = socket;
+                    fd.Events = POLLIN;
+                    int ready = sys_poll(ref fd, 1, rest);
+                    if (ready < 0)
+                    {
+                        if (Marshal.GetLastWin32Error() == EINTR) continue;
+                        // Netlink broke down, keep going by polling
+                        Close();
+                        return true;
+                    }
+                    if (ready > 0 && DrainEvents()) return true;
+                    if (ready == 0 || rest == 0) return false;
+                }
+            }
+        }
+
+        /// <summary>
+        /// Читает все накопленные события
+        /// </summary>
+        /// <returns>Среди них было событие hidraw или usb</returns>
+        private bool DrainEvents()
+        {
+            bool relevant = false;
+            while (true)
+            {
+                int readed = (int)sys_recv(socket, message, (UIntPtr)message.Length, MSG_DONTWAIT);
+                if (readed <= 0) return relevant;
+                // Kernel: "ACTION@DEVPATH\0KEY=VALUE\0...", udev: binary header followed by the same keys
+                string text = Encoding.ASCII.GetString(message, 0, readed);
+                if (text.Contains("SUBSYSTEM=hidraw\0") || text.Contains("SUBSYSTEM=usb\0"))
+                    relevant = true;
+            }
+        }
+
+        private void Close()
+        {
+            if (socket >= 0)
+            {
+                sys_close(socket);
+                socket = -1;
+            }
+        }
+
+        public void Dispose()
+        {
+            lock (sync) Close();
+        }
+    }
+}
@@ -0,0 +1,181 @@
+﻿using System;
+using System.Globalization;
+using System.IO;
+using System.Text;
+
+namespace DeliSu.TinyHidLoader
+{
+    /// <summary>
+    /// Качество связи с загрузчиком через конкретный порт USB
+    /// </summary>
+    /// <remarks>
+    /// Не всякий хаб доставляет низкоскоростному устройству отчёт целиком, тогда страница пишется
+    /// по частям (CAN_SUPPORT_HUB). Модель следит, как часто полные отчёты не проходят даже с повторами,
+    /// и при частых отказах сразу пишет по частям, изредка пробуя полный отчёт, чтобы вернуться.
+    /// Режим запоминается по пути к устройству между запусками. Модель используется, только если
+    /// загрузчик сообщает о записи по частям (LoaderCapabilities.FillPart).
+    /// </remarks>
+    public class LinkQuality
+    {
+        // Weight of the latest page in the fallback rate
+        const double WEIGHT = 0.25;
+        // About two fallbacks in a row switch to parts
+        const double TO_PARTS = 0.4;
+        const double TO_FULL = 0.15;
+        // Pages written by parts between probes of full reports
+        const int PROBE_INTERVAL = 16;
+        // Full report attempts per page before falling back to parts
+        internal const int FULL_ATTEMPTS = 3;
+
+        readonly string file;
+        int pagesSinceProbe;
+        bool changed;
+
+        /// <summary>
+        /// Страницы пишутся сразу по частям
+        /// </summary>
+        public bool UseParts { get; private set; }
+
+        /// <summary>
+        /// Сглаженная доля страниц, которые не прошли полными отчётами
+        /// </summary>
+        public double FallbackRate { get; private set; }
+
+        /// <summary>
+        /// Каталог сохранённых режимов по умолчанию, в локальных данных пользователя
+        /// </summary>
+        public static string DefaultDirectory
+        {
+            get
+            {
+                return Path.Combine(Path.Combine(Environment.GetFolderPath(Environment.SpecialFolder.LocalApplicationData),
+                    "TinyHidLoader"), "links");
+            }
+        }
+
+        /// <summary>
+        /// Модель без сохранения, начинает с полных отчётов
+        /// </summary>
+        public LinkQuality()
+        {
+        }
+
+        private LinkQuality(string file)
+        {
+            this.file = file;
+        }
+
+        /// <summary>
+        /// Модель порта, сохранённая прошлыми запусками
+        /// </summary>
+        /// <param name="directory">Каталог сохранённых режимов</param>
+        /// <param name="devicePath">Путь к устройству</param>
+        public static LinkQuality Load(string directory, string devicePath)
+        {
+            StringBuilder name = new StringBuilder();
+            foreach (char c in devicePath)
+                name.Append(char.IsLetterOrDigit(c) ? c : '_');
+            LinkQuality link = new LinkQuality(Path.Combine(directory, name.ToString() + ".link"));
+            try
+            {
+                if (!File.Exists(link.file)) return link;
+                string[] words = File.ReadAllText(link.file).Trim().Split(' ');
+                double rate;
+                if (words.Length == 2 && double.TryParse(words[1], NumberStyles.Float, CultureInfo.InvariantCulture, out rate))
+                {
+                    link.UseParts = words[0] == "parts";
+                    link.FallbackRate = Math.Max(0, Math.Min(1, rate));
+                }
+            }
+            catch (IOException)
+            {
+                // Start over with full reports
+            }
+            catch (UnauthorizedAccessException)
+            {
+            }
+            return link;
+        }
+
+        /// <summary>
+        /// Сколько раз пробовать полный отчёт для очередной страницы, 0 - сразу по частям
+        /// </summary>
+        public int FullAttempts()
+        {
+            if (!UseParts) return FULL_ATTEMPTS;
+            if (++pagesSinceProbe < PROBE_INTERVAL) return 0;
+            // Probe once, a failed probe costs one report
+            pagesSinceProbe = 0;
+            return 1;
+        }
+
+        /// <summary>
+        /// Учитывает страницу, для которой пробовался полный отчёт
+        /// </summary>
+        /// <param name="delivered">Полный отчёт прошёл, без записи по частям</param>
+        public void FullTried(bool delivered)
+        {
+            FallbackRate = FallbackRate * (1 - WEIGHT) + (delivered ? 0 : WEIGHT);
+            if (!UseParts && FallbackRate >= TO_PARTS)
+            {
+                UseParts = true;
+                pagesSinceProbe = 0;
+                changed = true;
+            }
+            else if (UseParts && FallbackRate <= TO_FULL)
+            {
+                UseParts = false;
+                changed = true;
+            }
+            else if (UseParts && delivered)
+            {
+                // The link may have recovered, probe the next page too
+                pagesSinceProbe = PROBE_INTERVAL - 1;
+            }
+        }
+
+        /// <summary>
+        /// Запись по частям не прошла: загрузчик без поддержки хабов, или связь плоха и для неё
+        /// </summary>
+        public void PartsFailed()
+        {
+            FallbackRate = 0;
+            if (UseParts)
+            {
+                UseParts = false;
+                changed = true;
+            }
+        }
+
+        /// <summary>
+        /// Сохраняет режим, если он изменился
+        /// </summary>
+        public void Save()
+        {
+            if (file == null || !changed) return;
+            try
+            {
+                Directory.CreateDirectory(Path.GetDirectoryName(file));
+                File.WriteAllText(file, ToFileString());
+                changed = false;
+            }
+            catch (IOException)
+            {
+                // Not remembered, the next run converges again
+            }
+            catch (UnauthorizedAccessException)
+            {
+            }
+        }
+
+        private string ToFileString()
+        {
+            return (UseParts ? "parts " : "full ") + FallbackRate.ToString("0.0000", CultureInfo.InvariantCulture);
+        }
+
+        public override string ToString()
+        {
+            return string.Format("link {0} {1:0.00}", UseParts ? "parts" : "full", FallbackRate);
+        }
+    }
+}
@@ -1,6 +1,7 @@
 ﻿using HidSharp;
 using System;
 using System.Collections.Generic;
+using System.Diagnostics;
 using System.IO;
 using System.Text;
 using System.Threading;
@@ -25,16 +26,69 @@ namespace DeliSu.TinyHidLoader
         public const int PAGESIZE = 64;
         public const int LOADERSTART = 0x1800 - 4;
         public const int FLASHSIZE = 0x2000;
-        const int REPORT_SIZE = PAGESIZE + 5;
-        const int REPORT_COMMAND = 1;
-        const int REPORT_CRC = 2;
-        const int REPORT_CMD_CHECK = 4;
-        const int REPORT_DATA = 5;
-        HidDevice dev;
+        internal const int REPORT_SIZE = PAGESIZE + 5;
+        internal const int REPORT_COMMAND = 1;
+        internal const int REPORT_CRC = 2;
+        internal const int REPORT_CMD_CHECK = 4;
+        internal const int REPORT_DATA = 5;
+        // Rescan even without hotplug events, in case one was missed
+        const int RESCAN_INTERVAL = 1000;
+        readonly ILoaderDevice dev;
+
+        /// <summary>
+        /// Задержки между командами, подобранные для этого устройства
+        /// </summary>
+        public LoaderPacer Pacer { get; private set; }
+
+        /// <summary>
+        /// Кэш crc16 страниц, запись в котором сбрасывается при очистке и записи FLASH, или null
+        /// </summary>
+        public DeltaCache Cache { get; set; }
+
+        /// <summary>
+        /// Ход чтения и записи во всех сессиях этого загрузчика
+        /// </summary>
+        public event EventHandler<LoaderProgressEventArgs> Progress;
+
+        /// <summary>
+        /// Трасса обмена для новых сессий, или null
+        /// </summary>
+        public LoaderTrace Trace { get; set; }
+
+        const int VID = 0x16c0;
+        const int PID = 0x05df;
+        const string VENDOR = "deli.su";
+        const string DEVICE = "TinyHID Loader";
 
         public static HidDevice Find(int vid, int pid, string vendor, string device, int featureSize)
+        {
+            return Find(vid, pid, vendor, device, featureSize, null);
+        }
+
+        /// <summary>
+        /// Ищет первое подходящее устройство
+        /// </summary>
+        /// <param name="serial">Серийный номер, или null для любого устройства</param>
+        public static HidDevice Find(int vid, int pid, string vendor, string device, int featureSize, string serial)
+        {
+            List<HidDevice> devices = FindAll(vid, pid, vendor, device, featureSize, serial);
+            return devices.Count > 0 ? devices[0] : null;
+        }
+
+        public static List<HidDevice> FindAll(int vid, int pid, string vendor, string device, int featureSize)
+        {
+            return FindAll(vid, pid, vendor, device, featureSize, null);
+        }
+
+        /// <summary>
+        /// Ищет все подходящие устройства
+        /// </summary>
+        /// <param name="serial">Серийный номер, или null для любого устройства</param>
+        /// <returns>Устройства, упорядоченные по пути</returns>
+        public static List<HidDevice> FindAll(int vid, int pid, string vendor, string device, int featureSize, string serial)
         {
             HidDeviceLoader ldr = new HidDeviceLoader();
+            List<HidDevice> result = new List<HidDevice>();
 
             foreach (HidDevice dev in ldr.GetDevices())
             {
@@ -43,28 +97,106 @@ namespace DeliSu.TinyHidLoader
                 if (vendor != null && dev.Manufacturer != vendor) continue;
                 if (device != null && dev.ProductName != device) continue;
                 if (featureSize != 0 && dev.MaxFeatureReportLength != featureSize) continue;
-                return dev;
+                if (serial != null && HidLoaderDevice.ReadSerialNumber(dev) != serial) continue;
+                result.Add(dev);
             }
-            return null;
+            result.Sort(delegate(HidDevice x, HidDevice y) { return string.CompareOrdinal(x.DevicePath, y.DevicePath); });
+            return result;
+        }
+
+        /// <summary>
+        /// Возвращает все подключённые загрузчики
+        /// </summary>
+        public static List<Loader> GetLoaders()
+        {
+            return GetLoaders(null);
+        }
+
+        /// <summary>
+        /// Возвращает все подключённые загрузчики с заданным серийным номером
+        /// </summary>
+        /// <param name="serial">Серийный номер, или null для всех загрузчиков</param>
+        public static List<Loader> GetLoaders(string serial)
+        {
+            List<Loader> result = new List<Loader>();
+            foreach (HidDevice dev in FindAll(VID, PID, VENDOR, DEVICE, REPORT_SIZE, serial))
+                result.Add(new Loader(dev));
+            return result;
         }
 
 
+        /// <summary>
+        /// Ждёт появления загрузчика
+        /// </summary>
+        /// <param name="timeout">Время ожидания, в секундах</param>
         public static Loader TryGetLoader(int timeout)
         {
-            for (int i = 0; ; i++)
+            return TryGetLoader(timeout, null);
+        }
+
+        /// <summary>
+        /// Ждёт появления загрузчика с заданным серийным номером
+        /// </summary>
+        /// <param name="timeout">Время ожидания, в секундах</param>
+        /// <param name="serial">Серийный номер, или null для любого загрузчика</param>
+        public static Loader TryGetLoader(int timeout, string serial)
+        {
+            Stopwatch watch = Stopwatch.StartNew();
+            using (HotplugWatcher watcher = new HotplugWatcher())
             {
-                try
+                while (true)
                 {
-                    return new Loader();
+                    try
+                    {
+                        return new Loader(serial);
+                    }
+                    catch
+                    {
+                        long rest = timeout * 1000L - watch.ElapsedMilliseconds;
+                        if (rest <= 0) throw;
+                        watcher.WaitForChange((int)Math.Min(rest, RESCAN_INTERVAL));
+                    }
                 }
-                catch
+            }
+        }
+
+        /// <summary>
+        /// Ждёт отключения устройства загрузчика
+        /// </summary>
+        /// <param name="timeout">Время ожидания, в миллисекундах</param>
+        /// <returns>true, если устройство отключилось</returns>
+        public bool WaitForRemoval(int timeout)
+        {
+            Stopwatch watch = Stopwatch.StartNew();
+            using (HotplugWatcher watcher = new HotplugWatcher(dev is HidLoaderDevice))
+            {
+                while (dev.IsPresent())
                 {
-                    if (i > timeout) throw;
-                    Thread.Sleep(1000);
+                    long rest = timeout - watch.ElapsedMilliseconds;
+                    if (rest <= 0) return false;
+                    watcher.WaitForChange((int)Math.Min(rest, RESCAN_INTERVAL));
                 }
             }
+            return true;
+        }
+
+        /// <summary>
+        /// Путь к устройству, однозначно определяет загрузчик среди подключённых
+        /// </summary>
+        public string DevicePath
+        {
+            get { return dev.DevicePath; }
         }
 
+        /// <summary>
+        /// Серийный номер загрузчика, или null, если загрузчик его не сообщает
+        /// </summary>
+        public string SerialNumber
+        {
+            get { return dev.SerialNumber; }
+        }
+
+
         public static byte Crc8(byte[] buffer, int offset, int count)
         {
             byte crc = 0;
@@ -86,22 +218,15 @@ namespace DeliSu.TinyHidLoader
 
         public static ushort Crc16(byte[] buffer, int offset, int count)
         {
-            ushort crc = 0xffff;
-            for(int j = 0; j < count; j++)
-            {
-                crc ^= buffer[offset++];
-                for (int i = 0; i < 8; ++i)
-                {
-                    if ((crc & 1) != 0)
-                        crc = (ushort)((crc >> 1) ^ 0xA001);
-                    else
-                        crc = (ushort)(crc >> 1);
-                }
-            }
-	        return crc;
+            return Crc16Table.Compute(buffer, offset, count);
         }
 
-        private static void SignBuffer(byte[] buffer)
+        public static ushort Crc16Update(ushort crc, byte data)
+        {
+            return Crc16Table.Update(crc, data);
+        }
+
+        internal static void SignBuffer(byte[] buffer)
         {
             buffer[REPORT_CMD_CHECK] = (byte)~buffer[REPORT_COMMAND];
             ushort crc = Crc16(buffer, REPORT_DATA, PAGESIZE);
@@ -110,9 +235,79 @@ namespace DeliSu.TinyHidLoader
         }
 
         public Loader()
+            : this((string)null)
+        {
+        }
+
+        /// <summary>
+        /// Находит загрузчик с заданным серийным номером
+        /// </summary>
+        /// <remarks>
+        /// Загрузчик должен быть скомпилирован с серийным номером (CAN_SERIAL_NUMBER)
+        /// </remarks>
+        /// <param name="serial">Серийный номер, или null для любого загрузчика</param>
+        public Loader(string serial)
+        {
+            HidDevice hid = Find(VID, PID, VENDOR, DEVICE, REPORT_SIZE, serial);
+            if (hid == null) throw new Exception("Device not found");
+            dev = new HidLoaderDevice(hid);
+            Pacer = CreatePacer(dev);
+            Cache = CreateCache(dev);
+        }
+
+        public Loader(HidDevice dev)
+            : this(new HidLoaderDevice(dev))
+        {
+        }
+
+        /// <summary>
+        /// Загрузчик на произвольном канале, например эмулированный
+        /// </summary>
+        public Loader(ILoaderDevice dev)
+        {
+            if (dev == null) throw new ArgumentNullException("dev");
+            this.dev = dev;
+            Pacer = CreatePacer(dev);
+            Cache = CreateCache(dev);
+        }
+
+        /// <summary>
+        /// Задержки по умолчанию и режим записи, запомненный для порта USB
+        /// </summary>
+        private static LoaderPacer CreatePacer(ILoaderDevice dev)
+        {
+            LoaderPacer pacer = new LoaderPacer();
+            // Emulated devices have no port to remember
+            if (dev is HidLoaderDevice) pacer.Link = LinkQuality.Load(LinkQuality.DefaultDirectory, dev.DevicePath);
+            return pacer;
+        }
+
+        /// <summary>
+        /// Кэш по умолчанию для настоящих устройств, у эмулятора кэша нет
+        /// </summary>
+        private static DeltaCache CreateCache(ILoaderDevice dev)
+        {
+            return dev is HidLoaderDevice ? new DeltaCache() : null;
+        }
+
+        /// <summary>
+        /// Открывает сессию с одним потоком к устройству для последовательности команд
+        /// </summary>
+        public LoaderSession OpenSession()
+        {
+            ILoaderTransport transport = dev.Open();
+            if (Trace != null) transport = new TracingTransport(transport, Trace, dev.DevicePath);
+            LoaderSession session = new LoaderSession(transport, Pacer);
+            session.Cache = Cache;
+            if (Cache != null) session.SerialNumber = SerialNumber;
+            session.Progress += OnSessionProgress;
+            return session;
+        }
+
+        private void OnSessionProgress(object sender, LoaderProgressEventArgs e)
         {
-            dev = Find(0x16c0, 0x05df, "deli.su", "TinyHID Loader", REPORT_SIZE);
-            if (dev == null) throw new Exception("Device not found");
+            EventHandler<LoaderProgressEventArgs> handler = Progress;
+            if (handler != null) handler(this, e);
         }
 
         /// <summary>
@@ -123,13 +318,7 @@ namespace DeliSu.TinyHidLoader
         /// </remarks>
         public void EraseEeprom()
         {
-            using (HidStream stream = dev.Open())
-            {
-                byte[] buffer = new byte[REPORT_SIZE];
-                buffer[REPORT_COMMAND] = (byte)LoaderCommand.EraseEeprom;
-                SignBuffer(buffer);
-                stream.SetFeature(buffer);
-            }
+            using (LoaderSession session = OpenSession()) session.EraseEeprom();
         }
 
         /// <summary>
@@ -137,13 +326,7 @@ namespace DeliSu.TinyHidLoader
         /// </summary>
         public void EraseFlash()
         {
-            using (HidStream stream = dev.Open())
-            {
-                byte[] buffer = new byte[REPORT_SIZE];
-                buffer[REPORT_COMMAND] = (byte)(LoaderCommand.EraseFlash | LoaderCommand.ResetAddress);
-                SignBuffer(buffer);
-                stream.SetFeature(buffer);
-            }
+            using (LoaderSession session = OpenSession()) session.EraseFlash();
         }
 
         /// <summary>
@@ -154,13 +337,19 @@ namespace DeliSu.TinyHidLoader
         /// </remarks>
         public void LeaveBootloader()
         {
-            using (HidStream stream = dev.Open())
-            {
-                byte[] buffer = new byte[REPORT_SIZE];
-                buffer[REPORT_COMMAND] = (byte)LoaderCommand.LeaveBootloader;
-                SignBuffer(buffer);
-                stream.SetFeature(buffer);
-            }
+            using (LoaderSession session = OpenSession()) session.LeaveBootloader();
+        }
+
+        /// <summary>
+        /// Читает состояние загрузчика
+        /// </summary>
+        /// <remarks>
+        /// Загрузчик должен быть скомпилирован с поддержкой отчёта о состоянии
+        /// </remarks>
+        /// <returns>Состояние, или null, если загрузчик не поддерживает отчёт о состоянии</returns>
+        public LoaderStatus ReadStatus()
+        {
+            using (LoaderSession session = OpenSession()) return session.ReadStatus();
         }
 
         /// <summary>
@@ -177,28 +366,7 @@ namespace DeliSu.TinyHidLoader
         /// <returns>Количество прочтённых данных</returns>
         public int ReadFlash(byte[] programm, int offset)
         {
-            using (HidStream stream = dev.Open())
-            {
-                byte[] buffer = new byte[REPORT_SIZE];
-                buffer[REPORT_COMMAND] = (byte)(LoaderCommand.ResetAddress);
-                SignBuffer(buffer);
-                stream.SetFeature(buffer);
-                int readed = 0;
-                while(true)
-                {
-                    stream.GetFeature(buffer);
-                    ushort crc = (ushort)(buffer[REPORT_CRC] | ((ushort)buffer[REPORT_CRC + 1] << 8));
-
-                    if (crc != Crc16(buffer, REPORT_DATA, PAGESIZE))
-                        throw new IOException("transfer fails, try again");
-
-                    for (int i = REPORT_DATA; i < PAGESIZE + REPORT_DATA; i++)
-                    {
-                        programm[offset++] = buffer[i];
-                        if (++readed >= LOADERSTART) return readed;
-                    }
-                }
-            }
+            using (LoaderSession session = OpenSession()) return session.ReadFlash(programm, offset);
         }
 
         /// <summary>
@@ -214,29 +382,7 @@ namespace DeliSu.TinyHidLoader
         /// <returns>Количество прочитанных байт</returns>
         public int ReadFlash(Stream stream)
         {
-            using (HidStream dstream = dev.Open())
-            {
-                byte[] buffer = new byte[REPORT_SIZE];
-                buffer[REPORT_COMMAND] = (byte)(LoaderCommand.ResetAddress);
-                SignBuffer(buffer);
-                dstream.SetFeature(buffer);
-                int readed = 0;
-                while (true)
-                {
-                    dstream.GetFeature(buffer);
-                    ushort crc = (ushort)(buffer[REPORT_CRC] | ((ushort)buffer[REPORT_CRC + 1] << 8));
-
-                    if (crc != Crc16(buffer, REPORT_DATA, PAGESIZE))
-                        throw new IOException("transfer fails, try again");
-
-                    int rest = PAGESIZE;
-                    if (readed + PAGESIZE >= LOADERSTART) rest = LOADERSTART - readed;
-                    stream.Write(buffer, 2, rest);
-
-                    readed += PAGESIZE;
-                    if (readed >= LOADERSTART) return readed;
-                }
-            }
+            using (LoaderSession session = OpenSession()) return session.ReadFlash(stream);
         }
 
         /// <summary>
@@ -250,89 +396,98 @@ namespace DeliSu.TinyHidLoader
         /// <returns></returns>
         public int WriteFlash(byte[] programm, int offset)
         {
-            using (HidStream stream = dev.Open())
-            {
-                byte[] buffer = new byte[REPORT_SIZE];
+            using (LoaderSession session = OpenSession()) return session.WriteFlash(programm, offset);
+        }
 
-                int writed = 0;
-                while (true)
-                {
-                    buffer[REPORT_COMMAND] = (byte)(LoaderCommand.WriteFlash | LoaderCommand.FillFlash);
-                    if (writed == 0) buffer[REPORT_COMMAND] |= (byte)(LoaderCommand.EraseFlash | LoaderCommand.ResetAddress);
+        /// <summary>
+        /// Пишет образ в flash
+        /// </summary>
+        /// <param name="image">Образ прошивки, не меньше LOADERSTART</param>
+        /// <returns>Количество записанных данных</returns>
+        public int WriteFlash(FlashImage image)
+        {
+            using (LoaderSession session = OpenSession()) return session.WriteFlash(image);
+        }
 
-                    for (int i = REPORT_DATA; i < REPORT_DATA + PAGESIZE; i++)
-                    {
-                        if (++writed >= LOADERSTART)
-                        {
-                            buffer[i] = 0xff;
-                            writed = LOADERSTART;
-                        }
-                        else
-                        {
-                            buffer[i] = programm[offset++];
-                        }
-                    }
-                    for (int i = 0; ; i++)
-                    {
-                        try
-                        {
-                            SignBuffer(buffer);
-                            // Не факт, что устройство уже аклималось, или что USB контроллер его подхватил снова
-                            // Так что возможны и вылеты. И раз они есть - то надо пробовать снова и снова.
-                            if (i < 3)
-                            {
-                                stream.SetFeature(buffer);
-                            }
-                            else
-                            {
-                                WriteByParts(stream, programm, offset - PAGESIZE);
-                            }
-                            break;
-                        }
-                        catch
-                        {
-                            if (i > 20) throw new Exception("can`t write at " + (writed - PAGESIZE));
-                            Thread.Sleep(20);
-                        }
-                    }
-                    if (buffer[REPORT_COMMAND] == (byte)(LoaderCommand.WriteFlash | LoaderCommand.FillFlash))
-                    {
-                        Thread.Sleep(5);
-                    }
-                    else
-                    {
-                        Thread.Sleep(500);
-                    }
-                    if (writed >= LOADERSTART) return writed;
-                }
+        /// <summary>
+        /// Пишет в flash готовый план
+        /// </summary>
+        /// <returns>Количество записанных данных</returns>
+        public int WriteFlash(FlashPlan plan)
+        {
+            using (LoaderSession session = OpenSession()) return session.WriteFlash(plan);
+        }
+
+        /// <summary>
+        /// Пишет только страницы, изменившиеся с последней записи этого устройства
+        /// </summary>
+        /// <param name="image">Образ прошивки, не меньше LOADERSTART</param>
+        /// <param name="cache">Кэш crc16 страниц, или null для записи целиком</param>
+        /// <returns>Количество отправленных страниц</returns>
+        public int WriteFlash(FlashImage image, DeltaCache cache)
+        {
+            using (LoaderSession session = OpenSession()) return session.WriteFlash(image, cache, SerialNumber);
+        }
+
+        /// <summary>
+        /// Начинает запись образа в flash в своей сессии
+        /// </summary>
+        /// <remarks>
+        /// Сессия закрывается по завершении операции, до вызова callback
+        /// </remarks>
+        /// <param name="image">Образ прошивки, не меньше LOADERSTART</param>
+        /// <param name="cancellation">Запрос отмены, или null</param>
+        public IAsyncResult BeginWriteFlash(FlashImage image, LoaderCancellation cancellation, AsyncCallback callback, object state)
+        {
+            LoaderSession session = OpenSession();
+            try
+            {
+                return session.BeginWriteFlash(image, cancellation, callback, state, session);
+            }
+            catch
+            {
+                session.Dispose();
+                throw;
             }
         }
 
-        private void WriteByParts(HidStream stream, byte[] programm, int offset)
+        /// <summary>
+        /// Ждёт завершения записи
+        /// </summary>
+        /// <returns>Количество записанных данных</returns>
+        public int EndWriteFlash(IAsyncResult asyncResult)
         {
-            byte[] buffer = new byte[REPORT_SIZE];
-            buffer[REPORT_COMMAND] = (byte)(LoaderCommand.SetAddress | LoaderCommand.FillPart);
-            buffer[REPORT_DATA] = (byte)offset;
-            buffer[REPORT_DATA + 1] = (byte)(offset >> 8);
-            SignBuffer(buffer);
-            stream.SetFeature(buffer);
-            Thread.Sleep(1);
+            return LoaderOperation.End(asyncResult);
+        }
 
-            for (int i = 0; i < PAGESIZE / 4; i++)
+        /// <summary>
+        /// Начинает чтение FLASH в своей сессии
+        /// </summary>
+        /// <param name="programm">Образ прошивки</param>
+        /// <param name="offset">Смещение в массиве образа</param>
+        /// <param name="cancellation">Запрос отмены, или null</param>
+        public IAsyncResult BeginReadFlash(byte[] programm, int offset, LoaderCancellation cancellation,
+            AsyncCallback callback, object state)
+        {
+            LoaderSession session = OpenSession();
+            try
             {
-                buffer[REPORT_COMMAND] = (byte)(LoaderCommand.FillFlash | LoaderCommand.FillPart);
-                for (int j = 0; j < 4; j++)
-                {
-                    buffer[j + REPORT_DATA] = programm[offset++];
-                }
-                SignBuffer(buffer);
-                stream.SetFeature(buffer);
-                Thread.Sleep(1);
+                return session.BeginReadFlash(programm, offset, cancellation, callback, state, session);
             }
-            buffer[REPORT_COMMAND] = (byte)LoaderCommand.WriteFlash;
-            SignBuffer(buffer);
-            stream.SetFeature(buffer);
-            Thread.Sleep(5);
+            catch
+            {
+                session.Dispose();
+                throw;
+            }
+        }
+
+        /// <summary>
+        /// Ждёт завершения чтения FLASH
+        /// </summary>
+        /// <returns>Количество прочтённых данных</returns>
+        public int EndReadFlash(IAsyncResult asyncResult)
+        {
+            return LoaderOperation.End(asyncResult);
         }
     }
 }
@@ -0,0 +1,540 @@
+﻿using System;
+using System.Collections.Generic;
+using System.Diagnostics;
+using System.IO;
+using System.Net;
+using System.Net.Sockets;
+using System.Text;
+using System.Threading;
+
+namespace DeliSu.TinyHidLoader
+{
+    /// <summary>
+    /// Постоянно работающий сервис прошивки с очередью заданий
+    /// </summary>
+    /// <remarks>
+    /// Держит разобранные образы и открытые сессии к загрузчикам, задания принимает текстом
+    /// через TCP на 127.0.0.1, по одной команде в строке, и отвечает одной строкой
+    /// "OK ..." или "ERROR ..." после выполнения:
+    /// <code>
+    /// list                        - подключённые загрузчики
+    /// write [-n] TARGET FILE      - запись FILE (.hex, ELF или .plan), -n - не выходить из загрузчика
+    /// read TARGET FILE            - чтение FLASH в HEX файл
+    /// erase TARGET flash|eeprom   - стирание
+    /// quit                        - закрыть соединение
+    /// </code>
+    /// TARGET - серийный номер (или путь к устройству, если номера нет), либо * для любого
+    /// свободного загрузчика. У каждого загрузчика своя очередь и свой поток, задания для *
+    /// берёт первый освободившийся.
+    /// К порту на 127.0.0.1 может подключиться любой локальный пользователь, поэтому read
+    /// пишет только внутри OutputDirectory. Файлы для write читаются с правами сервиса.
+    /// </remarks>
+    public class LoaderDaemon : IDisposable
+    {
+        public const int DEFAULT_PORT = 4571;
+        public const string ANY = "*";
+        // How long a job waits for its loader to appear or free up before it fails
+        const int JOB_TIMEOUT = 60000;
+        // Rescan even without hotplug events, in case one was missed
+        const int RESCAN_INTERVAL = 1000;
+
+        class Job
+        {
+            public string Command;
+            public string Target;
+            public string Argument;
+            public bool Leave = true;
+            public bool Started;
+            public bool Cancelled;
+            public string Result;
+            public readonly ManualResetEvent Done = new ManualResetEvent(false);
+        }
+
+        class DeviceQueue
+        {
+            public string Key;
+            public Loader Loader;
+            public bool Present;
+            // The thread starts once discovery finds the loader
+            public bool Running;
+            public LoaderSession Session;
+            public Loader SessionLoader;
+            public readonly Queue<Job> Jobs = new Queue<Job>();
+        }
+
+        class CachedPlan
+        {
+            public DateTime Time;
+            public long Length;
+            public FlashPlan Plan;
+        }
+
+        readonly object sync = new object();
+        readonly Dictionary<string, DeviceQueue> devices = new Dictionary<string, DeviceQueue>();
+        readonly Queue<Job> shared = new Queue<Job>();
+        readonly Dictionary<string, CachedPlan> plans = new Dictionary<string, CachedPlan>();
+        readonly TcpListener listener;
+        string outputDirectory;
+        bool stopped;
+
+        /// <summary>
+        /// Вызывается при каждом выполненном задании, из потока загрузчика
+        /// </summary>
+        public event EventHandler<LoaderDaemonEventArgs> JobCompleted;
+
+        public LoaderDaemon()
+            : this(DEFAULT_PORT)
+        {
+        }
+
+        /// <param name="port">Порт на 127.0.0.1</param>
+        public LoaderDaemon(int port)
+        {
+            listener = new TcpListener(IPAddress.Loopback, port);
+            OutputDirectory = Environment.CurrentDirectory;
+        }
+
+        /// <summary>
+        /// Каталог, внутри которого read сохраняет файлы; относительные пути - от него
+        /// </summary>
+        public string OutputDirectory
+        {
+            get { return outputDirectory; }
+            set { outputDirectory = Path.GetFullPath(value); }
+        }
+
+        /// <summary>
+        /// Фактический адрес, например после запуска на порту 0
+        /// </summary>
+        public IPEndPoint LocalEndpoint
+        {
+            get { return (IPEndPoint)listener.LocalEndpoint; }
+        }
+
+        /// <summary>
+        /// Начинает поиск загрузчиков и приём заданий
+        /// </summary>
+        public void Start()
+        {
+            listener.Start();
+            StartThread(DiscoveryLoop);
+            StartThread(AcceptLoop);
+        }
+
+        /// <summary>
+        /// Прекращает приём заданий и закрывает сессии; уже выполняемое задание доводится до конца
+        /// </summary>
+        public void Stop()
+        {
+            lock (sync)
+            {
+                if (stopped) return;
+                stopped = true;
+                Monitor.PulseAll(sync);
+            }
+            listener.Stop();
+        }
+
+        public void Dispose()
+        {
+            Stop();
+        }
+
+        private static void StartThread(ThreadStart start)
+        {
+            Thread thread = new Thread(start);
+            thread.IsBackground = true;
+            thread.Start();
+        }
+
+        /// <summary>
+        /// Список загрузчиков для обслуживания
+        /// </summary>
+        protected virtual List<Loader> FindLoaders()
+        {
+            return Loader.GetLoaders();
+        }
+
+        private static string KeyOf(Loader ldr)
+        {
+            return ldr.SerialNumber ?? ldr.DevicePath;
+        }
+
+        private void DiscoveryLoop()
+        {
+            using (HotplugWatcher watcher = new HotplugWatcher())
+            {
+                while (true)
+                {
+                    List<Loader> loaders;
+                    try
+                    {
+                        loaders = FindLoaders();
+                    }
+                    catch (Exception)
+                    {
+                        loaders = new List<Loader>();
+                    }
+                    lock (sync)
+                    {
+                        if (stopped) return;
+                        foreach (DeviceQueue queue in devices.Values) queue.Present = false;
+                        foreach (Loader ldr in loaders)
+                        {
+                            DeviceQueue queue = GetQueue(KeyOf(ldr));
+                            if (!queue.Running)
+                            {
+                                queue.Running = true;
+                                StartThread(delegate { DeviceLoop(queue); });
+                            }
+                            // Keep the known instance with its tuned pacer while the device stays at the same path
+                            if (queue.Loader == null || queue.Loader.DevicePath != ldr.DevicePath) queue.Loader = ldr;
+                            queue.Present = true;
+                        }
+                        Monitor.PulseAll(sync);
+                    }
+                    watcher.WaitForChange(RESCAN_INTERVAL);
+                }
+            }
+        }
+
+        /// <summary>
+        /// Очередь загрузчика; вызывается под sync
+        /// </summary>
+        private DeviceQueue GetQueue(string key)
+        {
+            DeviceQueue queue;
+            if (!devices.TryGetValue(key, out queue))
+            {
+                queue = new DeviceQueue();
+                queue.Key = key;
+                devices.Add(key, queue);
+            }
+            return queue;
+        }
+
+        private void DeviceLoop(DeviceQueue queue)
+        {
+            while (true)
+            {
+                Job job;
+                Loader ldr;
+                lock (sync)
+                {
+                    while ((job = NextJob(queue)) == null)
+                    {
+                        if (stopped)
+                        {
+                            CloseSession(queue);
+                            return;
+                        }
+                        Monitor.Wait(sync);
+                    }
+                    job.Started = true;
+                    ldr = queue.Loader;
+                }
+                Execute(queue, ldr, job);
+            }
+        }
+
+        /// <summary>
+        /// Своё задание, иначе общее; вызывается под sync
+        /// </summary>
+        private Job NextJob(DeviceQueue queue)
+        {
+            if (stopped || !queue.Present) return null;
+            foreach (Queue<Job> jobs in new Queue<Job>[] { queue.Jobs, shared })
+            {
+                while (jobs.Count > 0)
+                {
+                    Job job = jobs.Dequeue();
+                    if (!job.Cancelled) return job;
+                }
+            }
+            return null;
+        }
+
+        private void Execute(DeviceQueue queue, Loader ldr, Job job)
+        {
+            Stopwatch watch = Stopwatch.StartNew();
+            string result;
+            try
+            {
+                if (queue.Session != null && queue.SessionLoader != ldr) CloseSession(queue);
+                if (queue.Session == null)
+                {
+                    queue.Session = ldr.OpenSession();
+                    queue.SessionLoader = ldr;
+                }
+                LoaderSession session = queue.Session;
+                string done;
+                switch (job.Command)
+                {
+                    case "write":
+                        FlashPlan plan = GetPlan(job.Argument);
+                        session.WriteFlash(plan);
+                        done = string.Format("{0} pages written", plan.ReportCount);
+                        if (job.Leave)
+                        {
+                            session.LeaveBootloader();
+                            CloseSession(queue);
+                            // The loader is gone until the next scan finds it again
+                            lock (sync) queue.Present = false;
+                        }
+                        break;
+                    case "read":
+                        byte[] programm = new byte[Loader.LOADERSTART];
+                        for (int i = 0; i < programm.Length; i++) programm[i] = 0xff;
+                        session.ReadFlash(programm, 0);
+                        HexFile hf = new HexFile();
+                        hf.Chunks.Add(new HexFile.HexChunk(0, programm));
+                        hf.Write(job.Argument);
+                        done = "flash saved";
+                        break;
+                    case "erase":
+                        if (job.Argument == "eeprom")
+                            session.EraseEeprom();
+                        else
+                            session.EraseFlash();
+                        done = job.Argument + " erased";
+                        break;
+                    default:
+                        throw new InvalidOperationException("unknown command " + job.Command);
+                }
+                result = string.Format("OK {0}: {1} in {2} ms", queue.Key, done, watch.ElapsedMilliseconds);
+            }
+            catch (Exception e)
+            {
+                // Next job reopens the session, the device may have been reconnected
+                CloseSession(queue);
+                result = string.Format("ERROR {0}: {1}", queue.Key, e.Message);
+            }
+            job.Result = result;
+            job.Done.Set();
+
+            EventHandler<LoaderDaemonEventArgs> handler = JobCompleted;
+            if (handler != null) handler(this, new LoaderDaemonEventArgs(queue.Key, job.Command, result));
+        }
+
+        private static void CloseSession(DeviceQueue queue)
+        {
+            if (queue.Session == null) return;
+            try
+            {
+                queue.Session.Dispose();
+            }
+            catch (Exception)
+            {
+                // Device has already gone
+            }
+            queue.Session = null;
+            queue.SessionLoader = null;
+        }
+
+        /// <summary>
+        /// Полный путь файла для read, только внутри OutputDirectory
+        /// </summary>
+        private string GetOutputPath(string filename)
+        {
+            string directory = OutputDirectory;
+            string path = Path.GetFullPath(Path.Combine(directory, filename));
+            string root = directory.EndsWith(Path.DirectorySeparatorChar.ToString()) ? directory : directory + Path.DirectorySeparatorChar;
+            StringComparison comparison = Path.DirectorySeparatorChar == '\\' ? StringComparison.OrdinalIgnoreCase : StringComparison.Ordinal;
+            if (!path.StartsWith(root, comparison))
+                throw new UnauthorizedAccessException("output must be inside " + directory);
+            return path;
+        }
+
+        /// <summary>
+        /// План записи файла, разобранный заново только после его изменения
+        /// </summary>
+        private FlashPlan GetPlan(string filename)
+        {
+            FileInfo info = new FileInfo(filename);
+            if (!info.Exists) throw new FileNotFoundException("file not found", filename);
+            string key = info.FullName;
+            lock (plans)
+            {
+                CachedPlan cached;
+                if (plans.TryGetValue(key, out cached) && cached.Time == info.LastWriteTimeUtc && cached.Length == info.Length)
+                    return cached.Plan;
+                cached = new CachedPlan();
+                cached.Time = info.LastWriteTimeUtc;
+                cached.Length = info.Length;
+                if (string.Equals(info.Extension, ".plan", StringComparison.OrdinalIgnoreCase))
+                    cached.Plan = FlashPlan.Load(key);
+                else if (ElfFile.IsElf(key))
+                    cached.Plan = FlashPlan.Create(new ElfFile(key).Flash);
+                else
+                    cached.Plan = FlashPlan.Create(new HexFile(key));
+                plans[key] = cached;
+                return cached.Plan;
+            }
+        }
+
+        private void AcceptLoop()
+        {
+            while (true)
+            {
+                TcpClient client;
+                try
+                {
+                    client = listener.AcceptTcpClient();
+                }
+                catch (SocketException)
+                {
+                    // Listener stopped
+                    return;
+                }
+                catch (ObjectDisposedException)
+                {
+                    return;
+                }
+                StartThread(delegate { Serve(client); });
+            }
+        }
+
+        private void Serve(TcpClient client)
+        {
+            try
+            {
+                using (client)
+                using (NetworkStream stream = client.GetStream())
+                {
+                    StreamReader reader = new StreamReader(stream, Encoding.UTF8);
+                    StreamWriter writer = new StreamWriter(stream, new UTF8Encoding(false));
+                    writer.NewLine = "\n";
+                    writer.AutoFlush = true;
+                    string line;
+                    while ((line = reader.ReadLine()) != null)
+                    {
+                        line = line.Trim();
+                        if (line.Length == 0) continue;
+                        if (line == "quit") break;
+                        writer.WriteLine(Handle(line));
+                    }
+                }
+            }
+            catch (IOException)
+            {
+                // Client went away
+            }
+        }
+
+        /// <summary>
+        /// Выполняет одну команду и возвращает строку ответа
+        /// </summary>
+        public string Handle(string line)
+        {
+            string[] words = line.Split(new char[] { ' ' }, 2, StringSplitOptions.RemoveEmptyEntries);
+            string command = words[0];
+            string rest = words.Length > 1 ? words[1] : "";
+            if (command == "list") return List();
+
+            Job job = new Job();
+            job.Command = command;
+            if (command == "write" && rest.StartsWith("-n "))
+            {
+                job.Leave = false;
+                rest = rest.Substring(3).TrimStart();
+            }
+            words = rest.Split(new char[] { ' ' }, 2, StringSplitOptions.RemoveEmptyEntries);
+            if (words.Length != 2 || command != "write" && command != "read" && command != "erase" ||
+                command == "erase" && words[1] != "flash" && words[1] != "eeprom")
+                return "ERROR bad command: " + line;
+            job.Target = words[0];
+            job.Argument = words[1];
+            if (command == "read")
+            {
+                try
+                {
+                    job.Argument = GetOutputPath(job.Argument);
+                }
+                catch (Exception e)
+                {
+                    return "ERROR " + e.Message;
+                }
+            }
+            return Submit(job);
+        }
+
+        private string List()
+        {
+            StringBuilder result = new StringBuilder("OK");
+            lock (sync)
+            {
+                List<string> keys = new List<string>();
+                foreach (DeviceQueue queue in devices.Values)
+                    if (queue.Present) keys.Add(queue.Key);
+                keys.Sort(StringComparer.Ordinal);
+                foreach (string key in keys) result.Append(' ').Append(key);
+            }
+            return result.ToString();
+        }
+
+        /// <summary>
+        /// Удаляет очередь цели, которую поиск так и не нашёл, если в ней не осталось заданий; вызывается под sync
+        /// </summary>
+        private void DropUnknown(string key)
+        {
+            DeviceQueue queue;
+            if (!devices.TryGetValue(key, out queue) || queue.Running) return;
+            foreach (Job job in queue.Jobs)
+                if (!job.Cancelled) return;
+            devices.Remove(key);
+        }
+
+        private string Submit(Job job)
+        {
+            lock (sync)
+            {
+                if (stopped) return "ERROR daemon is stopping";
+                if (job.Target == ANY)
+                    shared.Enqueue(job);
+                else
+                    GetQueue(job.Target).Jobs.Enqueue(job);
+                Monitor.PulseAll(sync);
+            }
+            if (!job.Done.WaitOne(JOB_TIMEOUT, false))
+            {
+                lock (sync)
+                {
+                    if (!job.Started)
+                    {
+                        job.Cancelled = true;
+                        DropUnknown(job.Target);
+                        return "ERROR " + job.Target + ": loader not found or busy";
+                    }
+                }
+                job.Done.WaitOne();
+            }
+            job.Done.Close();
+            return job.Result;
+        }
+    }
+
+    /// <summary>
+    /// Выполненное задание сервиса прошивки
+    /// </summary>
+    public class LoaderDaemonEventArgs : EventArgs
+    {
+        /// <summary>
+        /// Серийный номер или путь загрузчика
+        /// </summary>
+        public string Device { get; private set; }
+
+        public string Command { get; private set; }
+
+        /// <summary>
+        /// Строка ответа, "OK ..." или "ERROR ..."
+        /// </summary>
+        public string Result { get; private set; }
+
+        public LoaderDaemonEventArgs(string device, string command, string result)
+        {
+            Device = device;
+            Command = command;
+            Result = result;
+        }
+    }
+}
@@ -0,0 +1,271 @@
+﻿using System;
+using System.Collections.Generic;
+using System.Diagnostics;
+using System.IO;
+using System.Text;
+using System.Threading;
+
+namespace DeliSu.TinyHidLoader
+{
+    /// <summary>
+    /// Запрос отмены асинхронной операции
+    /// </summary>
+    /// <remarks>
+    /// Операция проверяет запрос между обменами с устройством и завершается OperationCanceledException.
+    /// FLASH при этом остаётся записанной частично.
+    /// </remarks>
+    public class LoaderCancellation
+    {
+        volatile bool cancelled;
+
+        public bool IsCancellationRequested
+        {
+            get { return cancelled; }
+        }
+
+        public void Cancel()
+        {
+            cancelled = true;
+        }
+
+        public void ThrowIfCancellationRequested()
+        {
+            if (cancelled) throw new OperationCanceledException("operation cancelled");
+        }
+    }
+
+    /// <summary>
+    /// Результат операции, составленной из шагов
+    /// </summary>
+    internal class StepResult
+    {
+        public int Value;
+    }
+
+    /// <summary>
+    /// Асинхронная операция с загрузчиком
+    /// </summary>
+    /// <remarks>
+    /// Операция - перечисление шагов, каждый шаг - обмен с устройством, а возвращаемое значение -
+    /// пауза перед следующим шагом в миллисекундах. Шаги выполняются в пуле потоков,
+    /// а паузы отсчитывает общий для всех операций планировщик, так что ожидание не занимает поток.
+    /// </remarks>
+    internal class LoaderOperation : IAsyncResult
+    {
+        readonly IEnumerator<double> steps;
+        readonly StepResult result;
+        readonly LoaderCancellation cancellation;
+        readonly AsyncCallback callback;
+        readonly object state;
+        readonly IDisposable owner;
+        readonly ManualResetEvent done = new ManualResetEvent(false);
+        volatile bool completed;
+        int completing;
+        Exception error;
+
+        private LoaderOperation(IEnumerable<double> steps, StepResult result, LoaderCancellation cancellation,
+            AsyncCallback callback, object state, IDisposable owner)
+        {
+            this.steps = steps.GetEnumerator();
+            this.result = result;
+            this.cancellation = cancellation;
+            this.callback = callback;
+            this.state = state;
+            this.owner = owner;
+        }
+
+        /// <summary>
+        /// Запускает операцию
+        /// </summary>
+        /// <param name="owner">Объект, освобождаемый по завершении операции, или null</param>
+        public static LoaderOperation Start(IEnumerable<double> steps, StepResult result, LoaderCancellation cancellation,
+            AsyncCallback callback, object state, IDisposable owner)
+        {
+            LoaderOperation operation = new LoaderOperation(steps, result, cancellation, callback, state, owner);
+            ThreadPool.QueueUserWorkItem(operation.Step);
+            return operation;
+        }
+
+        /// <summary>
+        /// Ждёт завершения операции
+        /// </summary>
+        /// <remarks>
+        /// Ошибка из пула потоков выбрасывается обёрнутой, исходная со своим стеком - в InnerException
+        /// </remarks>
+        /// <returns>Результат операции</returns>
+        public static int End(IAsyncResult asyncResult)
+        {
+            LoaderOperation operation = asyncResult as LoaderOperation;
+            if (operation == null) throw new ArgumentException("not a loader operation", "asyncResult");
+            operation.done.WaitOne();
+            Exception error = operation.error;
+            if (error is OperationCanceledException) throw new OperationCanceledException(error.Message, error);
+            if (error != null) throw new IOException(error.Message, error);
+            return operation.result != null ? operation.result.Value : 0;
+        }
+
+        /// <summary>
+        /// Синхронно выполняет шаги в текущем потоке
+        /// </summary>
+        public static void Run(IEnumerable<double> steps)
+        {
+            foreach (double delay in steps) AdaptiveDelay.Wait(delay);
+        }
+
+        internal void Step(object unused)
+        {
+            bool finished;
+            Exception failure = null;
+            try
+            {
+                if (cancellation != null) cancellation.ThrowIfCancellationRequested();
+                finished = !steps.MoveNext();
+                if (!finished)
+                {
+                    double delay = steps.Current;
+                    if (delay <= 0)
+                        ThreadPool.QueueUserWorkItem(Step);
+                    else
+                        StepScheduler.Schedule(this, delay);
+                }
+            }
+            catch (Exception e)
+            {
+                finished = true;
+                failure = e;
+            }
+            // The callback runs outside the try, its exceptions are not the operation's
+            if (finished) Complete(failure);
+        }
+
+        private void Complete(Exception e)
+        {
+            if (Interlocked.Exchange(ref completing, 1) != 0) return;
+            error = e;
+            try
+            {
+                steps.Dispose();
+                if (owner != null) owner.Dispose();
+            }
+            catch (Exception disposeError)
+            {
+                if (error == null) error = disposeError;
+            }
+            completed = true;
+            done.Set();
+            if (callback != null) callback(this);
+        }
+
+        public object AsyncState
+        {
+            get { return state; }
+        }
+
+        public WaitHandle AsyncWaitHandle
+        {
+            get { return done; }
+        }
+
+        public bool CompletedSynchronously
+        {
+            get { return false; }
+        }
+
+        public bool IsCompleted
+        {
+            get { return completed; }
+        }
+    }
+
+    /// <summary>
+    /// Отсчёт пауз всех асинхронных операций в одном потоке
+    /// </summary>
+    /// <remarks>
+    /// Паузы между страницами - единицы миллисекунд, поэтому пока есть паузы, в Windows
+    /// системный таймер переводится на 1 мс. Поток блокируется до последней миллисекунды паузы,
+    /// и только её досчитывает по Stopwatch, уступая процессор.
+    /// </remarks>
+    internal static class StepScheduler
+    {
+        // Пауза длиннее этой ждётся блокировкой, короче - уступками процессора
+        const double BLOCKING_WAIT = 1;
+
+        class Entry
+        {
+            public LoaderOperation Operation;
+            public double Due;
+        }
+
+        static readonly object sync = new object();
+        static readonly List<Entry> entries = new List<Entry>();
+        static readonly Stopwatch clock = Stopwatch.StartNew();
+        static Thread thread;
+        static bool fineTimer;
+
+        public static void Schedule(LoaderOperation operation, double delay)
+        {
+            lock (sync)
+            {
+                Entry entry = new Entry();
+                entry.Operation = operation;
+                entry.Due = clock.Elapsed.TotalMilliseconds + delay;
+                entries.Add(entry);
+                if (thread == null)
+                {
+                    thread = new Thread(Loop);
+                    thread.IsBackground = true;
+                    thread.Name = "TinyHidLoader scheduler";
+                    thread.Start();
+                }
+                Monitor.Pulse(sync);
+            }
+        }
+
+        static void Loop()
+        {
+            while (true)
+            {
+                LoaderOperation ready = null;
+                lock (sync)
+                {
+                    if (entries.Count == 0)
+                    {
+                        SetFineTimer(false);
+                        Monitor.Wait(sync);
+                        continue;
+                    }
+                    SetFineTimer(true);
+                    int first = 0;
+                    for (int i = 1; i < entries.Count; i++)
+                        if (entries[i].Due < entries[first].Due) first = i;
+                    double remaining = entries[first].Due - clock.Elapsed.TotalMilliseconds;
+                    if (remaining <= 0)
+                    {
+                        ready = entries[first].Operation;
+                        entries.RemoveAt(first);
+                    }
+                    else if (remaining > BLOCKING_WAIT)
+                    {
+                        Monitor.Wait(sync, Math.Max(1, (int)(remaining - BLOCKING_WAIT)));
+                        continue;
+                    }
+                }
+                if (ready != null)
+                    ThreadPool.QueueUserWorkItem(ready.Step);
+                else
+                    Thread.Sleep(0);
+            }
+        }
+
+        /// <summary>
+        /// Держит таймер 1 мс, пока есть паузы
+        /// </summary>
+        static void SetFineTimer(bool enable)
+        {
+            if (fineTimer == enable) return;
+            if (enable) FineTimer.Begin();
+            else FineTimer.End();
+            fineTimer = enable;
+        }
+    }
+}
@@ -0,0 +1,180 @@
+﻿using System;
+using System.Collections.Generic;
+using System.Diagnostics;
+using System.Text;
+using System.Threading;
+
+namespace DeliSu.TinyHidLoader
+{
+    /// <summary>
+    /// Задержка, подстраивающаяся под устройство
+    /// </summary>
+    /// <remarks>
+    /// Пока устройство принимает команду с первой попытки, задержка уменьшается на шаг,
+    /// при отказе - удваивается. Измеренное время занятости устройства задаёт задержку напрямую.
+    /// </remarks>
+    public class AdaptiveDelay
+    {
+        // Запас к измеренному времени
+        const double MEASURE_MARGIN = 1.25;
+
+        public string Name { get; private set; }
+
+        /// <summary>
+        /// Текущая задержка, в миллисекундах
+        /// </summary>
+        public double Current { get; private set; }
+
+        public double Min { get; private set; }
+        public double Max { get; private set; }
+        public double Step { get; private set; }
+
+        /// <summary>
+        /// Количество отказов устройства после этой задержки
+        /// </summary>
+        public int Failures { get; private set; }
+
+        public AdaptiveDelay(string name, double initial, double min, double max, double step)
+        {
+            Name = name;
+            Current = initial;
+            Min = min;
+            Max = max;
+            Step = step;
+        }
+
+        /// <summary>
+        /// Ждёт текущую задержку
+        /// </summary>
+        public void Wait()
+        {
+            Wait(Current);
+        }
+
+        /// <summary>
+        /// Ждёт заданное время с точностью лучше кванта планировщика
+        /// </summary>
+        /// <param name="ms">Время, в миллисекундах</param>
+        public static void Wait(double ms)
+        {
+            if (ms <= 0) return;
+            Stopwatch watch = Stopwatch.StartNew();
+            if (ms >= 2)
+            {
+                FineTimer.Begin();
+                try
+                {
+                    Thread.Sleep((int)ms - 1);
+                }
+                finally
+                {
+                    FineTimer.End();
+                }
+            }
+            while (watch.Elapsed.TotalMilliseconds < ms) Thread.Sleep(0);
+        }
+
+        /// <summary>
+        /// Устройство приняло команду после задержки
+        /// </summary>
+        public void Success()
+        {
+            Current = Math.Max(Min, Current - Step);
+        }
+
+        /// <summary>
+        /// Устройство отказало после задержки
+        /// </summary>
+        public void Failure()
+        {
+            Failures++;
+            Current = Math.Min(Max, Current * 2 + Step);
+        }
+
+        /// <summary>
+        /// Учитывает измеренное время занятости устройства
+        /// </summary>
+        /// <param name="ms">Время, в миллисекундах</param>
+        public void Measure(double ms)
+        {
+            Current = Math.Max(Min, Math.Min(Max, ms * MEASURE_MARGIN));
+        }
+
+        public override string ToString()
+        {
+            return string.Format("{0} {1:0.0} ms", Name, Current);
+        }
+    }
+
+    /// <summary>
+    /// Задержки между командами загрузчику
+    /// </summary>
+    /// <remarks>
+    /// Во время записи FLASH загрузчик не отвечает на USB, и команды, отправленные слишком рано, отвергаются.
+    /// Задержки подбираются по отказам устройства, а очистка FLASH, если загрузчик сообщает состояние,
+    /// измеряется опросом состояния. Один экземпляр используется для одного устройства.
+    /// </remarks>
+    public class LoaderPacer
+    {
+        /// <summary>
+        /// После записи страницы
+        /// </summary>
+        public AdaptiveDelay Page { get; private set; }
+
+        /// <summary>
+        /// После очистки всей FLASH и записи первой страницы
+        /// </summary>
+        public AdaptiveDelay Erase { get; private set; }
+
+        /// <summary>
+        /// Между повторами отвергнутой команды и между опросами состояния
+        /// </summary>
+        public AdaptiveDelay Retry { get; private set; }
+
+        /// <summary>
+        /// Между частями страницы при записи по частям
+        /// </summary>
+        public AdaptiveDelay Part { get; private set; }
+
+        /// <summary>
+        /// Загрузчик сообщает состояние, null - ещё не известно
+        /// </summary>
+        public bool? StatusSupported { get; set; }
+
+        /// <summary>
+        /// Возможности из отчёта о состоянии, null - не известны
+        /// </summary>
+        public LoaderCapabilities? Capabilities { get; set; }
+
+        /// <summary>
+        /// Полные отчёты или запись по частям, по качеству связи с портом
+        /// </summary>
+        public LinkQuality Link { get; set; }
+
+        public LoaderPacer()
+        {
+            Page = new AdaptiveDelay("page", 5, 0, 50, 0.5);
+            Erase = new AdaptiveDelay("erase", 500, 20, 2000, 20);
+            Retry = new AdaptiveDelay("retry", 20, 1, 200, 1);
+            Part = new AdaptiveDelay("part", 1, 0, 20, 0.1);
+            Link = new LinkQuality();
+        }
+
+        /// <summary>
+        /// Задержки, заданные явно, например нулевые для эмулированного устройства
+        /// </summary>
+        public LoaderPacer(AdaptiveDelay page, AdaptiveDelay erase, AdaptiveDelay retry, AdaptiveDelay part)
+        {
+            Page = page;
+            Erase = erase;
+            Retry = retry;
+            Part = part;
+            Link = new LinkQuality();
+        }
+
+        public override string ToString()
+        {
+            return string.Format("{0}, {1}, {2}, {3}, {4}", Page, Erase, Retry, Part, Link);
+        }
+    }
+}
@@ -0,0 +1,1087 @@
+﻿using HidSharp;
+using System;
+using System.Collections.Generic;
+using System.Diagnostics;
+using System.IO;
+using System.Text;
+
+namespace DeliSu.TinyHidLoader
+{
+    /// <summary>
+    /// Шаг очереди команд сессии
+    /// </summary>
+    public delegate void LoaderStep();
+
+    /// <summary>
+    /// Ход выполнения операции
+    /// </summary>
+    public class LoaderProgressEventArgs : EventArgs
+    {
+        /// <summary>
+        /// Обработано байт
+        /// </summary>
+        public int Done { get; private set; }
+
+        /// <summary>
+        /// Всего байт
+        /// </summary>
+        public int Total { get; private set; }
+
+        /// <summary>
+        /// Отправлено или прочитано страниц
+        /// </summary>
+        public int PagesCommitted { get; private set; }
+
+        /// <summary>
+        /// Средняя скорость с начала операции
+        /// </summary>
+        public double BytesPerSecond { get; private set; }
+
+        public LoaderProgressEventArgs(int done, int total, int pagesCommitted, double bytesPerSecond)
+        {
+            Done = done;
+            Total = total;
+            PagesCommitted = pagesCommitted;
+            BytesPerSecond = bytesPerSecond;
+        }
+    }
+
+    /// <summary>
+    /// Сессия работы с загрузчиком
+    /// </summary>
+    /// <remarks>
+    /// Держит один открытый поток к устройству и заранее выделенные буферы отчётов,
+    /// так что последовательность команд не открывает устройство заново на каждую команду.
+    /// Команды можно выполнять сразу или поставить в очередь и выполнить одной операцией:
+    /// <code>session.QueueErase().QueueWrite(programm, 0).QueueVerify(programm, 0).QueueLeave().Execute();</code>
+    /// Длинные операции также есть в асинхронном виде (BeginWriteFlash/EndWriteFlash и т.п.):
+    /// паузы между страницами не занимают поток, так что одновременно можно вести много устройств.
+    /// Одна сессия выполняет одну операцию за раз.
+    /// </remarks>
+    public class LoaderSession : IDisposable
+    {
+        // Attempts to read the status before a write
+        const int PROBE_ATTEMPTS = 3;
+
+        ILoaderTransport stream;
+        readonly TracingTransport tracer;
+        readonly byte[] buffer = new byte[Loader.REPORT_SIZE];
+        readonly byte[] partBuffer = new byte[Loader.REPORT_SIZE];
+        readonly List<LoaderStep> queue = new List<LoaderStep>();
+        readonly Stopwatch progressWatch = new Stopwatch();
+        LoaderStatus probedStatus;
+
+        /// <summary>
+        /// Задержки между командами
+        /// </summary>
+        public LoaderPacer Pacer { get; private set; }
+
+        /// <summary>
+        /// Кэш crc16 страниц, или null: очистка и запись FLASH мимо кэша удаляют в нём запись устройства
+        /// </summary>
+        public DeltaCache Cache { get; set; }
+
+        /// <summary>
+        /// Серийный номер устройства в кэше, или null для устройства без него
+        /// </summary>
+        public string SerialNumber { get; set; }
+
+        /// <summary>
+        /// Вызывается после записи или чтения каждой страницы, в асинхронных операциях - из пула потоков
+        /// </summary>
+        public event EventHandler<LoaderProgressEventArgs> Progress;
+
+        public LoaderSession(HidDevice dev)
+            : this(dev, new LoaderPacer())
+        {
+        }
+
+        public LoaderSession(HidDevice dev, LoaderPacer pacer)
+            : this(new HidLoaderDevice(dev).Open(), pacer)
+        {
+        }
+
+        /// <summary>
+        /// Сессия на открытом канале, сессия закрывает его сама
+        /// </summary>
+        public LoaderSession(ILoaderTransport transport, LoaderPacer pacer)
+        {
+            if (transport == null) throw new ArgumentNullException("transport");
+            Pacer = pacer;
+            stream = transport;
+            tracer = transport as TracingTransport;
+        }
+
+        public void Dispose()
+        {
+            if (stream != null)
+            {
+                stream.Dispose();
+                stream = null;
+            }
+        }
+
+        private ILoaderTransport Transport
+        {
+            get
+            {
+                if (stream == null) throw new ObjectDisposedException("LoaderSession");
+                return stream;
+            }
+        }
+
+        private void SendCommand(LoaderCommand command)
+        {
+            Array.Clear(buffer, 0, buffer.Length);
+            buffer[Loader.REPORT_COMMAND] = (byte)command;
+            Loader.SignBuffer(buffer);
+            Transport.SetFeature(buffer);
+        }
+
+        private void ReadPage()
+        {
+            Transport.GetFeature(buffer);
+            ushort crc = (ushort)(buffer[Loader.REPORT_CRC] | ((ushort)buffer[Loader.REPORT_CRC + 1] << 8));
+            if (crc != Loader.Crc16(buffer, Loader.REPORT_DATA, Loader.PAGESIZE))
+                throw new IOException("transfer fails, try again");
+        }
+
+        /// <summary>
+        /// Очищает весь EEPROM
+        /// </summary>
+        /// <remarks>
+        /// Загрузчик должен быть скомпилирован с поддержкой очистки EEPROM
+        /// </remarks>
+        public void EraseEeprom()
+        {
+            SendCommand(LoaderCommand.EraseEeprom);
+        }
+
+        /// <summary>
+        /// Очищает всё FLASH-память
+        /// </summary>
+        public void EraseFlash()
+        {
+            InvalidateCache();
+            SendCommand(LoaderCommand.EraseFlash | LoaderCommand.ResetAddress);
+        }
+
+        /// <summary>
+        /// Удаляет запись устройства в кэше перед изменением FLASH
+        /// </summary>
+        private void InvalidateCache()
+        {
+            if (Cache != null && SerialNumber != null) Cache.Invalidate(SerialNumber);
+        }
+
+        /// <summary>
+        /// Выходит из режима загрузчика
+        /// </summary>
+        /// <remarks>
+        /// Загрузчик должен быть скомпилирован с поддержкой выхода
+        /// </remarks>
+        public void LeaveBootloader()
+        {
+            SendCommand(LoaderCommand.LeaveBootloader);
+        }
+
+        /// <summary>
+        /// Читает состояние загрузчика
+        /// </summary>
+        /// <remarks>
+        /// Загрузчик должен быть скомпилирован с поддержкой отчёта о состоянии
+        /// </remarks>
+        /// <returns>Состояние, или null, если загрузчик не поддерживает отчёт о состоянии</returns>
+        public LoaderStatus ReadStatus()
+        {
+            SendCommand(0);
+            try
+            {
+                Transport.GetFeature(buffer);
+            }
+            catch (IOException)
+            {
+                return null;
+            }
+            LoaderStatus status = LoaderStatus.Parse(buffer, Loader.REPORT_DATA);
+            if (status != null && (status.Capabilities & LoaderCapabilities.CheckData) != 0)
+            {
+                ushort crc = (ushort)(buffer[Loader.REPORT_CRC] | ((ushort)buffer[Loader.REPORT_CRC + 1] << 8));
+                if (crc != Loader.Crc16(buffer, Loader.REPORT_DATA, Loader.PAGESIZE))
+                    throw new IOException("transfer fails, try again");
+            }
+            return status;
+        }
+
+        /// <summary>
+        /// Читает содержимое FLASH вплоть до бутлодера, но не вместе с ним
+        /// </summary>
+        /// <remarks>
+        /// Бутлодеровскими также считаются последние 4 байта последней страницы данных перед ним.
+        /// Загрузчик должен быть скомпилирован с поддержкой чтения из Flash
+        /// </remarks>
+        /// <param name="programm">Образ прошивки</param>
+        /// <param name="offset">Смещение в массиве образа</param>
+        /// <returns>Количество прочтённых данных</returns>
+        public int ReadFlash(byte[] programm, int offset)
+        {
+            StepResult result = new StepResult();
+            LoaderOperation.Run(Traced(ReadFlashSteps(programm, offset, null, result)));
+            return result.Value;
+        }
+
+        /// <summary>
+        /// Читает содержимое FLASH вплоть до бутлодера, но не вместе с ним
+        /// </summary>
+        /// <remarks>
+        /// Бутлодеровскими также считаются последние 4 байта последней страницы данных перед ним.
+        /// Загрузчик должен быть скомпилирован с поддержкой чтения из Flash
+        /// </remarks>
+        /// <param name="output">Поток, в который считывается вся FLASH до загрузчика</param>
+        /// <returns>Количество прочитанных байт</returns>
+        public int ReadFlash(Stream output)
+        {
+            StepResult result = new StepResult();
+            LoaderOperation.Run(Traced(ReadFlashSteps(null, 0, output, result)));
+            return result.Value;
+        }
+
+        /// <summary>
+        /// Начинает чтение FLASH
+        /// </summary>
+        /// <param name="programm">Образ прошивки</param>
+        /// <param name="offset">Смещение в массиве образа</param>
+        /// <param name="cancellation">Запрос отмены, или null</param>
+        public IAsyncResult BeginReadFlash(byte[] programm, int offset, LoaderCancellation cancellation,
+            AsyncCallback callback, object state)
+        {
+            return BeginReadFlash(programm, offset, cancellation, callback, state, null);
+        }
+
+        internal IAsyncResult BeginReadFlash(byte[] programm, int offset, LoaderCancellation cancellation,
+            AsyncCallback callback, object state, IDisposable owner)
+        {
+            StepResult result = new StepResult();
+            return LoaderOperation.Start(Traced(ReadFlashSteps(programm, offset, null, result)), result, cancellation, callback, state, owner);
+        }
+
+        /// <summary>
+        /// Ждёт завершения чтения FLASH
+        /// </summary>
+        /// <returns>Количество прочтённых данных</returns>
+        public int EndReadFlash(IAsyncResult asyncResult)
+        {
+            return LoaderOperation.End(asyncResult);
+        }
+
+        private IEnumerable<double> ReadFlashSteps(byte[] programm, int offset, Stream output, StepResult result)
+        {
+            StartProgress();
+            SendCommand(LoaderCommand.ResetAddress);
+            int readed = 0;
+            int pages = 0;
+            while (readed < Loader.LOADERSTART)
+            {
+                ReadPage();
+                int rest = Math.Min(Loader.PAGESIZE, Loader.LOADERSTART - readed);
+                if (programm != null)
+                    Array.Copy(buffer, Loader.REPORT_DATA, programm, offset + readed, rest);
+                else
+                    output.Write(buffer, Loader.REPORT_DATA, rest);
+                readed += rest;
+                result.Value = readed;
+                OnProgress(readed, Loader.LOADERSTART, ++pages);
+                yield return 0;
+            }
+        }
+
+        /// <summary>
+        /// Сравнивает содержимое FLASH с образом
+        /// </summary>
+        /// <remarks>
+        /// Загрузчик должен быть скомпилирован с поддержкой чтения из Flash
+        /// </remarks>
+        /// <param name="programm">Образ прошивки</param>
+        /// <param name="offset">Смещение в массиве образа</param>
+        public void VerifyFlash(byte[] programm, int offset)
+        {
+            LoaderOperation.Run(Traced(VerifyFlashSteps(programm, offset)));
+        }
+
+        private IEnumerable<double> VerifyFlashSteps(byte[] programm, int offset)
+        {
+            StartProgress();
+            SendCommand(LoaderCommand.ResetAddress);
+            int readed = 0;
+            int pages = 0;
+            while (readed < Loader.LOADERSTART)
+            {
+                ReadPage();
+                int rest = Math.Min(Loader.PAGESIZE, Loader.LOADERSTART - readed);
+                for (int i = 0; i < rest; i++)
+                {
+                    if (IsLoaderVector(readed + i)) continue;
+                    if (buffer[Loader.REPORT_DATA + i] != programm[offset + readed + i])
+                        throw new IOException(string.Format("verify fails at 0x{0:X4}", readed + i));
+                }
+                readed += rest;
+                OnProgress(readed, Loader.LOADERSTART, ++pages);
+                yield return 0;
+            }
+        }
+
+        /// <summary>
+        /// Пишет программу в flash
+        /// </summary>
+        /// <remarks>
+        /// Бутлодеровскими также считаются последние 4 байта последней страницы данных перед ним
+        /// </remarks>
+        /// <param name="programm">Образ прошивки</param>
+        /// <param name="offset">Смещение в массиве образа</param>
+        /// <returns>Количество записанных данных</returns>
+        public int WriteFlash(byte[] programm, int offset)
+        {
+            return WriteFlash(FlashPlan.Create(programm, offset));
+        }
+
+        /// <summary>
+        /// Пишет в flash готовый план
+        /// </summary>
+        /// <returns>Количество записанных данных</returns>
+        public int WriteFlash(FlashPlan plan)
+        {
+            StepResult result = new StepResult();
+            LoaderOperation.Run(Traced(WriteFlashSteps(plan, result)));
+            return result.Value;
+        }
+
+        /// <summary>
+        /// Начинает запись программы в flash
+        /// </summary>
+        /// <param name="programm">Образ прошивки</param>
+        /// <param name="offset">Смещение в массиве образа</param>
+        /// <param name="cancellation">Запрос отмены, или null</param>
+        public IAsyncResult BeginWriteFlash(byte[] programm, int offset, LoaderCancellation cancellation,
+            AsyncCallback callback, object state)
+        {
+            return BeginWriteFlash(FlashPlan.Create(programm, offset), cancellation, callback, state);
+        }
+
+        /// <summary>
+        /// Начинает запись готового плана в flash
+        /// </summary>
+        /// <param name="plan">План записи, может одновременно использоваться несколькими сессиями</param>
+        /// <param name="cancellation">Запрос отмены, или null</param>
+        public IAsyncResult BeginWriteFlash(FlashPlan plan, LoaderCancellation cancellation, AsyncCallback callback, object state)
+        {
+            return BeginWriteFlash(plan, cancellation, callback, state, null);
+        }
+
+        internal IAsyncResult BeginWriteFlash(FlashPlan plan, LoaderCancellation cancellation, AsyncCallback callback,
+            object state, IDisposable owner)
+        {
+            StepResult result = new StepResult();
+            return LoaderOperation.Start(Traced(WriteFlashSteps(plan, result)), result, cancellation, callback, state, owner);
+        }
+
+        /// <summary>
+        /// Ждёт завершения записи
+        /// </summary>
+        /// <returns>Количество записанных данных, для записи с кэшем - количество отправленных страниц</returns>
+        public int EndWriteFlash(IAsyncResult asyncResult)
+        {
+            return LoaderOperation.End(asyncResult);
+        }
+
+        private IEnumerable<double> WriteFlashSteps(FlashPlan plan, StepResult result)
+        {
+            if (Pacer.StatusSupported == null)
+                foreach (double wait in ProbeStatusSteps()) yield return wait;
+            // Writing through the cache saves the new entry after this
+            InvalidateCache();
+
+            // Saved parts mode is trusted only for a loader that reports FillPart (CAN_SUPPORT_HUB).
+            // An unknown loader falls back to parts after the full attempts, one without FillPart never does:
+            // it would write each part as a whole report.
+            bool? canFillPart = null;
+            if (Pacer.Capabilities != null) canFillPart = (Pacer.Capabilities.Value & LoaderCapabilities.FillPart) != 0;
+
+            StartProgress();
+            // Задержка перед текущей страницей, которая подстраивается по результату её отправки
+            AdaptiveDelay delay = null;
+            for (int page = 0; page < plan.ReportCount; page++)
+            {
+                // Отчёт уже подписан, повторы отправляют его как есть
+                plan.CopyReport(page, buffer);
+                int address = page * Loader.PAGESIZE;
+                bool erases = (buffer[Loader.REPORT_COMMAND] & (byte)LoaderCommand.EraseFlash) != 0;
+                // Сколько полных отчётов пробовать до записи по частям, по качеству связи с портом
+                int fullAttempts;
+                if (canFillPart == true)
+                    fullAttempts = Pacer.Link.FullAttempts();
+                else
+                    fullAttempts = canFillPart == false ? int.MaxValue : LinkQuality.FULL_ATTEMPTS;
+                // Parts never erase, so the erasing report is always tried in full first
+                if (erases) fullAttempts = Math.Max(fullAttempts, LinkQuality.FULL_ATTEMPTS);
+                bool triedFull = false;
+                bool byParts = false;
+                bool erased = false;
+                int attempt = 0;
+                for (; ; attempt++)
+                {
+                    // Не факт, что устройство уже аклималось, или что USB контроллер его подхватил снова
+                    // Так что возможны и вылеты. И раз они есть - то надо пробовать снова и снова.
+                    bool sent;
+                    if (attempt < fullAttempts)
+                    {
+                        triedFull = true;
+                        byParts = false;
+                        sent = TrySend(buffer);
+                    }
+                    else
+                    {
+                        if (erases && !erased)
+                        {
+                            foreach (double wait in EraseBeforePartsSteps()) yield return wait;
+                            erased = true;
+                        }
+                        sent = true;
+                        byParts = true;
+                        double partsStart = tracer != null ? tracer.Trace.Now : 0;
+                        IEnumerator<double> parts = WriteByPartsSteps(buffer, Loader.REPORT_DATA, address).GetEnumerator();
+                        while (true)
+                        {
+                            bool more;
+                            try
+                            {
+                                more = parts.MoveNext();
+                            }
+                            catch
+                            {
+                                sent = false;
+                                break;
+                            }
+                            if (!more) break;
+                            yield return parts.Current;
+                        }
+                        if (sent)
+                        {
+                            Pacer.Part.Success();
+                        }
+                        else
+                        {
+                            Pacer.Part.Failure();
+                            if (canFillPart == true) Pacer.Link.PartsFailed();
+                            // Parts were chosen without trying full reports, give them their attempts now
+                            if (fullAttempts < LinkQuality.FULL_ATTEMPTS) fullAttempts = attempt + 1 + LinkQuality.FULL_ATTEMPTS;
+                        }
+                        if (tracer != null) tracer.Record(LoaderTrace.PARTS, partsStart, sent, address);
+                    }
+                    if (sent) break;
+                    TraceRetry(address);
+
+                    if (attempt == 0)
+                    {
+                        if (delay != null) delay.Failure();
+                    }
+                    else
+                    {
+                        Pacer.Retry.Failure();
+                    }
+                    if (attempt > 20)
+                    {
+                        Pacer.Link.Save();
+                        throw new Exception("can`t write at " + address);
+                    }
+                    yield return Pacer.Retry.Current;
+                }
+                if (triedFull && canFillPart == true) Pacer.Link.FullTried(!byParts);
+                if (attempt == 0)
+                {
+                    if (delay != null) delay.Success();
+                }
+                else
+                {
+                    Pacer.Retry.Success();
+                }
+                // Written by parts, the erase has already been waited for
+                if (!erases || byParts)
+                {
+                    yield return Pacer.Page.Current;
+                    delay = Pacer.Page;
+                }
+                else if (Pacer.StatusSupported == true)
+                {
+                    foreach (double wait in WaitReadySteps(Pacer.Erase)) yield return wait;
+                    delay = null;
+                }
+                else
+                {
+                    yield return Pacer.Erase.Current;
+                    delay = Pacer.Erase;
+                }
+                int writed = Math.Min(address + Loader.PAGESIZE, plan.Size);
+                result.Value = writed;
+                OnProgress(writed, plan.Size, page + 1);
+            }
+            Pacer.Link.Save();
+        }
+
+        /// <summary>
+        /// Пишет образ в flash
+        /// </summary>
+        /// <param name="image">Образ прошивки, не меньше LOADERSTART</param>
+        /// <returns>Количество записанных данных</returns>
+        public int WriteFlash(FlashImage image)
+        {
+            CheckImage(image);
+            return WriteFlash(image.Data, 0);
+        }
+
+        /// <summary>
+        /// Начинает запись образа в flash
+        /// </summary>
+        /// <param name="image">Образ прошивки, не меньше LOADERSTART</param>
+        /// <param name="cancellation">Запрос отмены, или null</param>
+        public IAsyncResult BeginWriteFlash(FlashImage image, LoaderCancellation cancellation, AsyncCallback callback, object state)
+        {
+            return BeginWriteFlash(image, cancellation, callback, state, null);
+        }
+
+        internal IAsyncResult BeginWriteFlash(FlashImage image, LoaderCancellation cancellation, AsyncCallback callback,
+            object state, IDisposable owner)
+        {
+            CheckImage(image);
+            return BeginWriteFlash(FlashPlan.Create(image), cancellation, callback, state, owner);
+        }
+
+        /// <summary>
+        /// Сравнивает содержимое FLASH с образом
+        /// </summary>
+        /// <param name="image">Образ прошивки, не меньше LOADERSTART</param>
+        public void VerifyFlash(FlashImage image)
+        {
+            CheckImage(image);
+            VerifyFlash(image.Data, 0);
+        }
+
+        /// <summary>
+        /// Начинает сравнение содержимого FLASH с образом
+        /// </summary>
+        /// <param name="image">Образ прошивки, не меньше LOADERSTART</param>
+        /// <param name="cancellation">Запрос отмены, или null</param>
+        public IAsyncResult BeginVerifyFlash(FlashImage image, LoaderCancellation cancellation, AsyncCallback callback, object state)
+        {
+            CheckImage(image);
+            return LoaderOperation.Start(Traced(VerifyFlashSteps(image.Data, 0)), null, cancellation, callback, state, null);
+        }
+
+        /// <summary>
+        /// Ждёт завершения сравнения, при расхождении бросает IOException
+        /// </summary>
+        public void EndVerifyFlash(IAsyncResult asyncResult)
+        {
+            LoaderOperation.End(asyncResult);
+        }
+
+        /// <summary>
+        /// Пишет образ, отправляя только страницы, изменившиеся с последней записи
+        /// </summary>
+        /// <remarks>
+        /// Нужен загрузчик с серийным номером, отчётом о состоянии и очисткой отдельной страницы.
+        /// Иначе, а также без записи в кэше, образ пишется целиком.
+        /// Первая и последняя страницы отправляются всегда: загрузчик переносит вектор сброса
+        /// приложения с первой страницы на последнюю.
+        /// Прерванная запись оставляет в кэше фактическое состояние FLASH: подтверждённые
+        /// загрузчиком страницы, стёртые страницы после них и недописанную страницу,
+        /// так что следующая запись продолжается с места обрыва без полной очистки.
+        /// </remarks>
+        /// <param name="image">Образ прошивки, не меньше LOADERSTART</param>
+        /// <param name="cache">Кэш crc16 страниц, или null для записи целиком</param>
+        /// <param name="serial">Серийный номер устройства, или null</param>
+        /// <returns>Количество отправленных страниц</returns>
+        public int WriteFlash(FlashImage image, DeltaCache cache, string serial)
+        {
+            CheckImage(image);
+            StepResult result = new StepResult();
+            LoaderOperation.Run(Traced(WriteFlashSteps(image, cache, serial, result)));
+            return result.Value;
+        }
+
+        /// <summary>
+        /// Начинает запись образа с пропуском неизменившихся страниц
+        /// </summary>
+        /// <param name="image">Образ прошивки, не меньше LOADERSTART</param>
+        /// <param name="cache">Кэш crc16 страниц, или null для записи целиком</param>
+        /// <param name="serial">Серийный номер устройства, или null</param>
+        /// <param name="cancellation">Запрос отмены, или null</param>
+        public IAsyncResult BeginWriteFlash(FlashImage image, DeltaCache cache, string serial, LoaderCancellation cancellation,
+            AsyncCallback callback, object state)
+        {
+            CheckImage(image);
+            StepResult result = new StepResult();
+            return LoaderOperation.Start(Traced(WriteFlashSteps(image, cache, serial, result)), result, cancellation, callback, state, null);
+        }
+
+        private IEnumerable<double> WriteFlashSteps(FlashImage image, DeltaCache cache, string serial, StepResult result)
+        {
+            int pages = (Loader.LOADERSTART + Loader.PAGESIZE - 1) / Loader.PAGESIZE;
+            ushort[] crcs = image.PageCrcs();
+            Array.Resize(ref crcs, pages);
+
+            ushort[] previous = null;
+            bool resumable = false;
+            // Without a cache there is nothing to compare with or to journal to
+            if (cache == null) serial = null;
+            if (serial != null)
+            {
+                foreach (double wait in ProbeStatusSteps()) yield return wait;
+                LoaderStatus status = probedStatus;
+                LoaderCapabilities required = LoaderCapabilities.SetAddress | LoaderCapabilities.ErasePage;
+                resumable = status != null && (status.Capabilities & required) == required;
+                if (resumable)
+                    previous = cache.Load(serial, pages);
+                // Interrupted write leaves unknown flash, until it is journaled below
+                cache.Invalidate(serial);
+            }
+
+            IEnumerator<double> steps;
+            StepResult written = new StepResult();
+            if (previous == null)
+                steps = WriteFlashSteps(FlashPlan.Create(image), written).GetEnumerator();
+            else
+                steps = WriteChangedPagesSteps(image, crcs, previous, written).GetEnumerator();
+            while (true)
+            {
+                try
+                {
+                    if (!steps.MoveNext()) break;
+                }
+                catch
+                {
+                    if (resumable)
+                    {
+                        ushort[] state = previous == null ? InterruptedFullWrite(crcs, written.Value) :
+                            InterruptedDeltaWrite(crcs, previous, written.Value);
+                        if (state != null) cache.Save(serial, state);
+                    }
+                    throw;
+                }
+                yield return steps.Current;
+            }
+            result.Value = previous == null ? pages : written.Value;
+            if (serial != null) cache.Save(serial, crcs);
+        }
+
+        /// <summary>
+        /// Пишет страницы, отличающиеся от кэша, и первую с последней
+        /// </summary>
+        /// <param name="result">Номер следующей страницы в старших битах и количество отправленных страниц в младших</param>
+        private IEnumerable<double> WriteChangedPagesSteps(FlashImage image, ushort[] crcs, ushort[] previous, StepResult result)
+        {
+            int pages = crcs.Length;
+            int sent = 0;
+            StartProgress();
+            for (int page = 0; page < pages; page++)
+            {
+                result.Value = page << 16 | sent;
+                if (page == 0 || page == pages - 1 || crcs[page] != previous[page])
+                {
+                    foreach (double wait in WritePageSteps(image.Data, page * Loader.PAGESIZE)) yield return wait;
+                    sent++;
+                }
+                OnProgress(Math.Min((page + 1) * Loader.PAGESIZE, Loader.LOADERSTART), Loader.LOADERSTART, sent);
+            }
+            result.Value = sent;
+        }
+
+        /// <summary>
+        /// Состояние FLASH после обрыва полной записи
+        /// </summary>
+        /// <remarks>
+        /// Полная запись стирает всю FLASH вместе с первой страницей и пишет страницы по порядку.
+        /// Записанной считается страница, которую загрузчик принял и после которой его адрес ушёл дальше;
+        /// без ответа о состоянии последняя принятая страница считается недописанной.
+        /// </remarks>
+        /// <param name="written">Байт, принятых загрузчиком</param>
+        /// <returns>crc16 страниц во FLASH, или null, если не известно даже, стёрта ли она</returns>
+        private ushort[] InterruptedFullWrite(ushort[] crcs, int written)
+        {
+            int committed = (written + Loader.PAGESIZE - 1) / Loader.PAGESIZE;
+            LoaderStatus status = TryGetStatus();
+            if (status != null)
+                committed = Math.Min(committed, status.Address / Loader.PAGESIZE);
+            else
+                committed--;
+            if (committed < 1) return null;
+
+            ushort erased = ErasedPageCrc();
+            ushort[] state = new ushort[crcs.Length];
+            for (int page = 0; page < state.Length; page++)
+                state[page] = page < committed ? crcs[page] : erased;
+            if (committed < state.Length) state[committed] = Mismatch(crcs[committed]);
+            return state;
+        }
+
+        /// <summary>
+        /// Состояние FLASH после обрыва частичной записи: страница в работе стёрта или недописана
+        /// </summary>
+        private static ushort[] InterruptedDeltaWrite(ushort[] crcs, ushort[] previous, int position)
+        {
+            int current = position >> 16;
+            ushort[] state = new ushort[crcs.Length];
+            for (int page = 0; page < state.Length; page++)
+                state[page] = page < current ? crcs[page] : previous[page];
+            state[current] = Mismatch(crcs[current]);
+            return state;
+        }
+
+        /// <summary>
+        /// crc16, который точно не совпадёт с crc16 образа, чтобы страница была записана заново
+        /// </summary>
+        private static ushort Mismatch(ushort crc)
+        {
+            return (ushort)~crc;
+        }
+
+        private static ushort ErasedPageCrc()
+        {
+            byte[] page = new byte[Loader.PAGESIZE];
+            for (int i = 0; i < page.Length; i++) page[i] = 0xff;
+            return Loader.Crc16(page, 0, page.Length);
+        }
+
+        private LoaderStatus TryGetStatus()
+        {
+            try
+            {
+                return ReadStatus();
+            }
+            catch
+            {
+                return null;
+            }
+        }
+
+        /// <summary>
+        /// Очищает и пишет одну страницу по адресу
+        /// </summary>
+        private IEnumerable<double> WritePageSteps(byte[] programm, int address)
+        {
+            Array.Clear(buffer, 0, buffer.Length);
+            buffer[Loader.REPORT_COMMAND] = (byte)(LoaderCommand.SetAddress | LoaderCommand.EraseFlash);
+            buffer[Loader.REPORT_DATA] = (byte)address;
+            buffer[Loader.REPORT_DATA + 1] = (byte)(address >> 8);
+            Loader.SignBuffer(buffer);
+            foreach (double wait in SendWithRetrySteps(address)) yield return wait;
+            yield return Pacer.Page.Current;
+
+            buffer[Loader.REPORT_COMMAND] = (byte)(LoaderCommand.FillFlash | LoaderCommand.WriteFlash);
+            for (int i = 0; i < Loader.PAGESIZE; i++)
+            {
+                int pos = address + i;
+                buffer[Loader.REPORT_DATA + i] = pos < Loader.LOADERSTART ? programm[pos] : (byte)0xff;
+            }
+            Loader.SignBuffer(buffer);
+            foreach (double wait in SendWithRetrySteps(address)) yield return wait;
+            yield return Pacer.Page.Current;
+        }
+
+        private IEnumerable<double> SendWithRetrySteps(int address)
+        {
+            for (int attempt = 0; !TrySend(buffer); attempt++)
+            {
+                TraceRetry(address);
+                if (attempt == 0) Pacer.Page.Failure();
+                else Pacer.Retry.Failure();
+                if (attempt > 20) throw new Exception("can`t write at " + address);
+                yield return Pacer.Retry.Current;
+            }
+            Pacer.Page.Success();
+        }
+
+        /// <summary>
+        /// Отправляет подписанный отчёт
+        /// </summary>
+        /// <returns>false, если устройство не приняло отчёт</returns>
+        private bool TrySend(byte[] report)
+        {
+            try
+            {
+                Transport.SetFeature(report);
+                return true;
+            }
+            catch
+            {
+                return false;
+            }
+        }
+
+        /// <summary>
+        /// Байт векторов сброса и PCINT, которые загрузчик заменяет переходом на себя
+        /// </summary>
+        private static bool IsLoaderVector(int address)
+        {
+            return address < 2 || (address >= 4 && address < 6);
+        }
+
+        /// <summary>
+        /// Отмечает в трассе неудачную отправку страницы, после которой будет повтор
+        /// </summary>
+        private void TraceRetry(int address)
+        {
+            if (tracer != null) tracer.Record(LoaderTrace.RETRY, tracer.Trace.Now, false, address);
+        }
+
+        /// <summary>
+        /// Отмечает в трассе фактическую длительность каждой паузы между шагами
+        /// </summary>
+        private IEnumerable<double> Traced(IEnumerable<double> steps)
+        {
+            if (tracer == null) return steps;
+            return TracedSteps(steps);
+        }
+
+        private IEnumerable<double> TracedSteps(IEnumerable<double> steps)
+        {
+            foreach (double wait in steps)
+            {
+                if (wait <= 0)
+                {
+                    yield return wait;
+                    continue;
+                }
+                double start = tracer.Trace.Now;
+                yield return wait;
+                tracer.Record(LoaderTrace.WAIT, start, true, -1);
+            }
+        }
+
+        private static void CheckImage(FlashImage image)
+        {
+            if (image.Size < Loader.LOADERSTART || image.PageSize != Loader.PAGESIZE)
+                throw new ArgumentException("image does not cover application flash", "image");
+        }
+
+        private void StartProgress()
+        {
+            progressWatch.Reset();
+            progressWatch.Start();
+        }
+
+        private void OnProgress(int done, int total, int pages)
+        {
+            EventHandler<LoaderProgressEventArgs> handler = Progress;
+            if (handler == null) return;
+            double seconds = progressWatch.Elapsed.TotalSeconds;
+            handler(this, new LoaderProgressEventArgs(done, total, pages, seconds > 0 ? done / seconds : 0));
+        }
+
+        /// <summary>
+        /// Ждёт, пока загрузчик снова начнёт отвечать, опрашивая состояние
+        /// </summary>
+        /// <param name="delay">Задержка, которая учитывает измеренное время</param>
+        private IEnumerable<double> WaitReadySteps(AdaptiveDelay delay)
+        {
+            Stopwatch watch = Stopwatch.StartNew();
+            yield return delay.Min;
+            while (!TryReadStatus())
+            {
+                if (watch.ElapsedMilliseconds > delay.Max) throw new IOException("loader does not respond");
+                yield return Pacer.Retry.Current;
+            }
+            delay.Measure(watch.Elapsed.TotalMilliseconds);
+        }
+
+        /// <summary>
+        /// Читает состояние перед записью, повторяя при искажённом ответе
+        /// </summary>
+        /// <remarks>
+        /// Если состояние так и не прочиталось, probedStatus остаётся null, а поддержка отчёта
+        /// о состоянии - неизвестной: запись идёт с фиксированными задержками, а не прерывается.
+        /// </remarks>
+        private IEnumerable<double> ProbeStatusSteps()
+        {
+            probedStatus = null;
+            for (int attempt = 1; ; attempt++)
+            {
+                bool read;
+                try
+                {
+                    probedStatus = ReadStatus();
+                    read = true;
+                }
+                catch
+                {
+                    read = false;
+                }
+                if (read)
+                {
+                    Pacer.StatusSupported = probedStatus != null;
+                    if (probedStatus != null) Pacer.Capabilities = probedStatus.Capabilities;
+                    yield break;
+                }
+                if (attempt >= PROBE_ATTEMPTS) yield break;
+                yield return Pacer.Retry.Current;
+            }
+        }
+
+        private bool TryReadStatus()
+        {
+            try
+            {
+                return ReadStatus() != null;
+            }
+            catch
+            {
+                return false;
+            }
+        }
+
+        /// <summary>
+        /// Стирает FLASH отдельной командой перед записью первой страницы по частям
+        /// </summary>
+        private IEnumerable<double> EraseBeforePartsSteps()
+        {
+            Array.Clear(partBuffer, 0, partBuffer.Length);
+            partBuffer[Loader.REPORT_COMMAND] = (byte)(LoaderCommand.EraseFlash | LoaderCommand.ResetAddress);
+            Loader.SignBuffer(partBuffer);
+            for (int attempt = 0; !TrySend(partBuffer); attempt++)
+            {
+                TraceRetry(0);
+                Pacer.Retry.Failure();
+                if (attempt > 20) throw new Exception("can`t erase flash");
+                yield return Pacer.Retry.Current;
+            }
+            if (Pacer.StatusSupported == true)
+            {
+                foreach (double wait in WaitReadySteps(Pacer.Erase)) yield return wait;
+            }
+            else
+            {
+                yield return Pacer.Erase.Current;
+            }
+        }
+
+        /// <summary>
+        /// Пишет страницу по 4 байта, ошибка отправки выходит из перечисления исключением
+        /// </summary>
+        /// <param name="data">Данные страницы</param>
+        /// <param name="offset">Смещение данных страницы в массиве</param>
+        /// <param name="address">Адрес страницы</param>
+        private IEnumerable<double> WriteByPartsSteps(byte[] data, int offset, int address)
+        {
+            Array.Clear(partBuffer, 0, partBuffer.Length);
+            partBuffer[Loader.REPORT_COMMAND] = (byte)(LoaderCommand.SetAddress | LoaderCommand.FillPart);
+            partBuffer[Loader.REPORT_DATA] = (byte)address;
+            partBuffer[Loader.REPORT_DATA + 1] = (byte)(address >> 8);
+            Loader.SignBuffer(partBuffer);
+            Transport.SetFeature(partBuffer);
+            yield return Pacer.Part.Current;
+
+            for (int i = 0; i < Loader.PAGESIZE / 4; i++)
+            {
+                partBuffer[Loader.REPORT_COMMAND] = (byte)(LoaderCommand.FillFlash | LoaderCommand.FillPart);
+                for (int j = 0; j < 4; j++)
+                {
+                    partBuffer[j + Loader.REPORT_DATA] = data[offset++];
+                }
+                Loader.SignBuffer(partBuffer);
+                Transport.SetFeature(partBuffer);
+                yield return Pacer.Part.Current;
+            }
+            partBuffer[Loader.REPORT_COMMAND] = (byte)LoaderCommand.WriteFlash;
+            Loader.SignBuffer(partBuffer);
+            Transport.SetFeature(partBuffer);
+        }
+
+        /// <summary>
+        /// Ставит в очередь очистку FLASH
+        /// </summary>
+        public LoaderSession QueueErase()
+        {
+            queue.Add(EraseFlash);
+            return this;
+        }
+
+        /// <summary>
+        /// Ставит в очередь запись программы
+        /// </summary>
+        /// <param name="programm">Образ прошивки</param>
+        /// <param name="offset">Смещение в массиве образа</param>
+        public LoaderSession QueueWrite(byte[] programm, int offset)
+        {
+            queue.Add(delegate { WriteFlash(programm, offset); });
+            return this;
+        }
+
+        /// <summary>
+        /// Ставит в очередь запись образа
+        /// </summary>
+        public LoaderSession QueueWrite(FlashImage image)
+        {
+            queue.Add(delegate { WriteFlash(image); });
+            return this;
+        }
+
+        /// <summary>
+        /// Ставит в очередь запись готового плана
+        /// </summary>
+        public LoaderSession QueueWrite(FlashPlan plan)
+        {
+            queue.Add(delegate { WriteFlash(plan); });
+            return this;
+        }
+
+        /// <summary>
+        /// Ставит в очередь проверку записанной программы
+        /// </summary>
+        /// <param name="programm">Образ прошивки</param>
+        /// <param name="offset">Смещение в массиве образа</param>
+        public LoaderSession QueueVerify(byte[] programm, int offset)
+        {
+            queue.Add(delegate { VerifyFlash(programm, offset); });
+            return this;
+        }
+
+        /// <summary>
+        /// Ставит в очередь проверку записанного образа
+        /// </summary>
+        public LoaderSession QueueVerify(FlashImage image)
+        {
+            queue.Add(delegate { VerifyFlash(image); });
+            return this;
+        }
+
+        /// <summary>
+        /// Ставит в очередь выход из загрузчика
+        /// </summary>
+        public LoaderSession QueueLeave()
+        {
+            queue.Add(LeaveBootloader);
+            return this;
+        }
+
+        /// <summary>
+        /// Ставит в очередь произвольный шаг
+        /// </summary>
+        public LoaderSession Queue(LoaderStep step)
+        {
+            queue.Add(step);
+            return this;
+        }
+
+        /// <summary>
+        /// Выполняет очередь команд по порядку
+        /// </summary>
+        /// <remarks>
+        /// Очередь очищается в любом случае. Если шаг завершился ошибкой, следующие шаги не выполняются.
+        /// </remarks>
+        public void Execute()
+        {
+            LoaderStep[] steps = queue.ToArray();
+            queue.Clear();
+            foreach (LoaderStep step in steps) step();
+        }
+    }
+}
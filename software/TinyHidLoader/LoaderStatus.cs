@@ -0,0 +1,136 @@
+﻿using System;
+using System.Collections.Generic;
+using System.Text;
+
+namespace DeliSu.TinyHidLoader
+{
+    /// <summary>
+    /// Возможности, с которыми скомпилирован загрузчик
+    /// </summary>
+    [Flags]
+    public enum LoaderCapabilities : byte
+    {
+        EraseEeprom = 0x01,
+        ReadFlash = 0x02,
+        LeaveLoader = 0x04,
+        CheckData = 0x08,
+        SetAddress = 0x10,
+        ErasePage = 0x20,
+        FillPart = 0x40,
+    }
+
+    /// <summary>
+    /// Состояние загрузчика
+    /// </summary>
+    /// <remarks>
+    /// Загрузчик должен быть скомпилирован с поддержкой отчёта о состоянии (CAN_REPORT_STATUS)
+    /// </remarks>
+    public class LoaderStatus
+    {
+        const byte SIGNATURE = (byte)'S';
+        const int STATUS_SIGNATURE = 0;
+        const int STATUS_CAPS = 1;
+        const int STATUS_ADDRESS = 2;
+        const int STATUS_SETUP_TICKS = 4;
+        const int STATUS_TICK_RATE = 6;
+        const int STATUS_TICKS = 8;
+        const int STATUS_MAGIC = 10;
+        const int MAGIC = 0x4c54;
+        // Capability bits no loader reports yet
+        const LoaderCapabilities RESERVED = (LoaderCapabilities)0x80;
+        const int NOT_SEEN = 0xffff;
+
+        public LoaderCapabilities Capabilities { get; private set; }
+
+        /// <summary>
+        /// Текущий адрес записи или чтения FLASH
+        /// </summary>
+        public int Address { get; private set; }
+
+        /// <summary>
+        /// Тики таймера от подключения к USB до первого SETUP-пакета, 0xffff если хост ещё не обращался
+        /// </summary>
+        public int SetupTicks { get; private set; }
+
+        /// <summary>
+        /// Тики таймера от подключения к USB
+        /// </summary>
+        public int Ticks { get; private set; }
+
+        /// <summary>
+        /// Частота тиков таймера, в герцах
+        /// </summary>
+        public int TickRate { get; private set; }
+
+        /// <summary>
+        /// Время от подключения к USB до первого SETUP-пакета от хоста
+        /// </summary>
+        public TimeSpan? EnumerationTime
+        {
+            get
+            {
+                if (SetupTicks == NOT_SEEN || TickRate == 0) return null;
+                return TimeSpan.FromMilliseconds(SetupTicks * 1000.0 / TickRate);
+            }
+        }
+
+        /// <summary>
+        /// Время от подключения к USB
+        /// </summary>
+        public TimeSpan Uptime
+        {
+            get
+            {
+                if (TickRate == 0) return TimeSpan.Zero;
+                return TimeSpan.FromMilliseconds(Ticks * 1000.0 / TickRate);
+            }
+        }
+
+        /// <summary>
+        /// Разбирает данные отчёта о состоянии
+        /// </summary>
+        /// <param name="buffer">Отчёт</param>
+        /// <param name="offset">Смещение данных в отчёте</param>
+        /// <remarks>
+        /// Загрузчик без отчёта о состоянии, но с чтением FLASH, отвечает данными FLASH,
+        /// поэтому отчёт узнаётся по двум сигнатурам и по отсутствию неизвестных возможностей.
+        /// </remarks>
+        /// <returns>Состояние, или null, если отчёт не является отчётом о состоянии</returns>
+        public static LoaderStatus Parse(byte[] buffer, int offset)
+        {
+            if (buffer[offset + STATUS_SIGNATURE] != SIGNATURE || ReadWord(buffer, offset + STATUS_MAGIC) != MAGIC) return null;
+            LoaderCapabilities caps = (LoaderCapabilities)buffer[offset + STATUS_CAPS];
+            if ((caps & RESERVED) != 0) return null;
+
+            LoaderStatus status = new LoaderStatus();
+            status.Capabilities = caps;
+            status.Address = ReadWord(buffer, offset + STATUS_ADDRESS);
+            status.SetupTicks = ReadWord(buffer, offset + STATUS_SETUP_TICKS);
+            status.TickRate = ReadWord(buffer, offset + STATUS_TICK_RATE);
+            status.Ticks = ReadWord(buffer, offset + STATUS_TICKS);
+            return status;
+        }
+
+        static int ReadWord(byte[] buffer, int offset)
+        {
+            return buffer[offset] | (buffer[offset + 1] << 8);
+        }
+
+        public override string ToString()
+        {
+            StringBuilder sb = new StringBuilder();
+            sb.AppendFormat("Capabilities: {0}", Capabilities);
+            sb.AppendLine();
+            sb.AppendFormat("Address: 0x{0:X4}", Address);
+            sb.AppendLine();
+            TimeSpan? enumeration = EnumerationTime;
+            if (enumeration.HasValue)
+                sb.AppendFormat("Connect to first SETUP: {0} ms", (int)enumeration.Value.TotalMilliseconds);
+            else
+                sb.Append("Connect to first SETUP: not seen");
+            sb.AppendLine();
+            sb.AppendFormat("Uptime: {0} ms", (int)Uptime.TotalMilliseconds);
+            return sb.ToString();
+        }
+    }
+}
@@ -0,0 +1,301 @@
+﻿using System;
+using System.Collections.Generic;
+using System.Diagnostics;
+using System.Globalization;
+using System.IO;
+using System.Text;
+
+namespace DeliSu.TinyHidLoader
+{
+    /// <summary>
+    /// Одно событие обмена с загрузчиком
+    /// </summary>
+    public class LoaderTraceEvent
+    {
+        /// <summary>
+        /// Путь к устройству
+        /// </summary>
+        public string Device { get; private set; }
+
+        /// <summary>
+        /// Фаза: set, get, wait, retry, parts
+        /// </summary>
+        public string Kind { get; private set; }
+
+        /// <summary>
+        /// Начало от создания трассы, в миллисекундах
+        /// </summary>
+        public double Start { get; private set; }
+
+        /// <summary>
+        /// Длительность, в миллисекундах
+        /// </summary>
+        public double Duration { get; private set; }
+
+        public bool Success { get; private set; }
+
+        /// <summary>
+        /// Адрес страницы, или -1
+        /// </summary>
+        public int Address { get; private set; }
+
+        public LoaderTraceEvent(string device, string kind, double start, double duration, bool success, int address)
+        {
+            Device = device;
+            Kind = kind;
+            Start = start;
+            Duration = duration;
+            Success = success;
+            Address = address;
+        }
+    }
+
+    /// <summary>
+    /// Трасса обмена с загрузчиками: каждый отчёт, пауза, повтор и переход на запись по частям
+    /// </summary>
+    /// <remarks>
+    /// Одна трасса может собирать события нескольких устройств из разных потоков.
+    /// По событиям строятся гистограммы длительностей по фазам и JSON для сбора статистики по стендам.
+    /// </remarks>
+    public class LoaderTrace
+    {
+        public const string SET = "set";
+        public const string GET = "get";
+        public const string WAIT = "wait";
+        public const string RETRY = "retry";
+        public const string PARTS = "parts";
+
+        // Histogram bucket upper bounds, in milliseconds; the last bucket is unbounded
+        static readonly double[] bounds = { 0.1, 0.2, 0.5, 1, 2, 5, 10, 20, 50, 100, 200, 500 };
+
+        readonly object sync = new object();
+        readonly List<LoaderTraceEvent> events = new List<LoaderTraceEvent>();
+        readonly Stopwatch watch = Stopwatch.StartNew();
+        readonly DateTime started = DateTime.UtcNow;
+
+        /// <summary>
+        /// Время от создания трассы, в миллисекундах
+        /// </summary>
+        public double Now
+        {
+            get { return watch.Elapsed.TotalMilliseconds; }
+        }
+
+        public void Record(string device, string kind, double start, double duration, bool success, int address)
+        {
+            LoaderTraceEvent e = new LoaderTraceEvent(device, kind, start, duration, success, address);
+            lock (sync) events.Add(e);
+        }
+
+        /// <summary>
+        /// Копия всех событий в порядке записи
+        /// </summary>
+        public List<LoaderTraceEvent> GetEvents()
+        {
+            lock (sync) return new List<LoaderTraceEvent>(events);
+        }
+
+        /// <summary>
+        /// Длительности событий по фазам, отсортированные
+        /// </summary>
+        private SortedDictionary<string, List<double>> GetPhases(List<LoaderTraceEvent> list)
+        {
+            SortedDictionary<string, List<double>> phases = new SortedDictionary<string, List<double>>(StringComparer.Ordinal);
+            foreach (LoaderTraceEvent e in list)
+            {
+                List<double> durations;
+                if (!phases.TryGetValue(e.Kind, out durations))
+                {
+                    durations = new List<double>();
+                    phases.Add(e.Kind, durations);
+                }
+                durations.Add(e.Duration);
+            }
+            foreach (List<double> durations in phases.Values) durations.Sort();
+            return phases;
+        }
+
+        private static int[] Histogram(List<double> durations)
+        {
+            int[] counts = new int[bounds.Length + 1];
+            foreach (double d in durations)
+            {
+                int bucket = 0;
+                while (bucket < bounds.Length && d > bounds[bucket]) bucket++;
+                counts[bucket]++;
+            }
+            return counts;
+        }
+
+        private static double Percentile(List<double> sorted, double p)
+        {
+            if (sorted.Count == 0) return 0;
+            return sorted[Math.Min(sorted.Count - 1, (int)(p * sorted.Count))];
+        }
+
+        /// <summary>
+        /// Сводка по фазам для вывода в консоль
+        /// </summary>
+        public string Summary()
+        {
+            List<LoaderTraceEvent> list = GetEvents();
+            int failed = 0;
+            foreach (LoaderTraceEvent e in list)
+                if (!e.Success) failed++;
+
+            StringBuilder sb = new StringBuilder();
+            sb.AppendFormat(CultureInfo.InvariantCulture, "{0} events, {1} failed", list.Count, failed);
+            foreach (KeyValuePair<string, List<double>> phase in GetPhases(list))
+            {
+                List<double> d = phase.Value;
+                double total = 0;
+                foreach (double x in d) total += x;
+                sb.AppendLine();
+                sb.AppendFormat(CultureInfo.InvariantCulture,
+                    "{0,-6} n={1,-6} total {2,9:F1} ms  p50 {3,7:F2}  p90 {4,7:F2}  p99 {5,7:F2}  max {6,7:F2} ms",
+                    phase.Key, d.Count, total, Percentile(d, 0.5), Percentile(d, 0.9), Percentile(d, 0.99), d[d.Count - 1]);
+                sb.AppendLine();
+                sb.Append("       ");
+                int[] counts = Histogram(d);
+                for (int i = 0; i < counts.Length; i++)
+                {
+                    if (counts[i] == 0) continue;
+                    string bound = i < bounds.Length ? "<=" + bounds[i].ToString(CultureInfo.InvariantCulture) : ">" + bounds[i - 1].ToString(CultureInfo.InvariantCulture);
+                    sb.AppendFormat(" {0}:{1}", bound, counts[i]);
+                }
+            }
+            return sb.ToString();
+        }
+
+        public void WriteJson(string filename)
+        {
+            using (StreamWriter writer = new StreamWriter(filename, false, new UTF8Encoding(false))) WriteJson(writer);
+        }
+
+        /// <summary>
+        /// Пишет события и гистограммы по фазам в JSON
+        /// </summary>
+        public void WriteJson(TextWriter writer)
+        {
+            List<LoaderTraceEvent> list = GetEvents();
+            CultureInfo inv = CultureInfo.InvariantCulture;
+            writer.Write("{\"started\":\"");
+            writer.Write(started.ToString("yyyy-MM-ddTHH:mm:ss.fffZ", inv));
+            writer.Write("\",\"bounds_ms\":[");
+            for (int i = 0; i < bounds.Length; i++)
+            {
+                if (i > 0) writer.Write(',');
+                writer.Write(bounds[i].ToString(inv));
+            }
+            writer.Write("],\"phases\":{");
+            bool first = true;
+            foreach (KeyValuePair<string, List<double>> phase in GetPhases(list))
+            {
+                List<double> d = phase.Value;
+                if (!first) writer.Write(',');
+                first = false;
+                writer.Write(string.Format(inv, "\"{0}\":{{\"count\":{1},\"p50_ms\":{2:R},\"p90_ms\":{3:R},\"p99_ms\":{4:R},\"max_ms\":{5:R},\"histogram\":[",
+                    phase.Key, d.Count, Percentile(d, 0.5), Percentile(d, 0.9), Percentile(d, 0.99), d[d.Count - 1]));
+                int[] counts = Histogram(d);
+                for (int i = 0; i < counts.Length; i++)
+                {
+                    if (i > 0) writer.Write(',');
+                    writer.Write(counts[i].ToString(inv));
+                }
+                writer.Write("]}");
+            }
+            writer.Write("},\"events\":[");
+            for (int i = 0; i < list.Count; i++)
+            {
+                LoaderTraceEvent e = list[i];
+                if (i > 0) writer.Write(',');
+                writer.WriteLine();
+                writer.Write(string.Format(inv, "{{\"device\":\"{0}\",\"kind\":\"{1}\",\"t_ms\":{2:F3},\"ms\":{3:F3},\"ok\":{4}",
+                    Escape(e.Device), e.Kind, e.Start, e.Duration, e.Success ? "true" : "false"));
+                if (e.Address >= 0) writer.Write(string.Format(inv, ",\"address\":{0}", e.Address));
+                writer.Write('}');
+            }
+            writer.WriteLine("]}");
+        }
+
+        private static string Escape(string value)
+        {
+            if (value == null) return "";
+            StringBuilder sb = new StringBuilder(value.Length);
+            foreach (char c in value)
+            {
+                if (c == '"' || c == '\\') sb.Append('\\').Append(c);
+                else if (c < ' ') sb.AppendFormat("\\u{0:x4}", (int)c);
+                else sb.Append(c);
+            }
+            return sb.ToString();
+        }
+    }
+
+    /// <summary>
+    /// Канал, который отмечает в трассе каждый отчёт
+    /// </summary>
+    /// <remarks>
+    /// LoaderSession на таком канале добавляет в ту же трассу паузы, повторы и запись по частям.
+    /// </remarks>
+    public class TracingTransport : ILoaderTransport
+    {
+        readonly ILoaderTransport inner;
+
+        public LoaderTrace Trace { get; private set; }
+
+        public string Device { get; private set; }
+
+        public TracingTransport(ILoaderTransport inner, LoaderTrace trace, string device)
+        {
+            if (inner == null) throw new ArgumentNullException("inner");
+            if (trace == null) throw new ArgumentNullException("trace");
+            this.inner = inner;
+            Trace = trace;
+            Device = device;
+        }
+
+        /// <summary>
+        /// Отмечает событие этого устройства, начавшееся в start
+        /// </summary>
+        public void Record(string kind, double start, bool success, int address)
+        {
+            Trace.Record(Device, kind, start, Trace.Now - start, success, address);
+        }
+
+        public void SetFeature(byte[] report)
+        {
+            double start = Trace.Now;
+            try
+            {
+                inner.SetFeature(report);
+            }
+            catch
+            {
+                Record(LoaderTrace.SET, start, false, -1);
+                throw;
+            }
+            Record(LoaderTrace.SET, start, true, -1);
+        }
+
+        public void GetFeature(byte[] report)
+        {
+            double start = Trace.Now;
+            try
+            {
+                inner.GetFeature(report);
+            }
+            catch
+            {
+                Record(LoaderTrace.GET, start, false, -1);
+                throw;
+            }
+            Record(LoaderTrace.GET, start, true, -1);
+        }
+
+        public void Dispose()
+        {
+            inner.Dispose();
+        }
+    }
+}
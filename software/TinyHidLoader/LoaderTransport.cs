@@ -0,0 +1,127 @@
+﻿using HidSharp;
+using System;
+using System.Collections.Generic;
+using System.Text;
+
+namespace DeliSu.TinyHidLoader
+{
+    /// <summary>
+    /// Открытый канал к загрузчику
+    /// </summary>
+    /// <remarks>
+    /// Отчёты передаются целиком, первый байт - номер отчёта (0).
+    /// Отказ устройства (STALL, нет ответа) выходит исключением IOException.
+    /// </remarks>
+    public interface ILoaderTransport : IDisposable
+    {
+        void SetFeature(byte[] report);
+        void GetFeature(byte[] report);
+    }
+
+    /// <summary>
+    /// Устройство загрузчика
+    /// </summary>
+    public interface ILoaderDevice
+    {
+        /// <summary>
+        /// Путь к устройству, однозначно определяет загрузчик среди подключённых
+        /// </summary>
+        string DevicePath { get; }
+
+        /// <summary>
+        /// Серийный номер, или null, если загрузчик его не сообщает
+        /// </summary>
+        string SerialNumber { get; }
+
+        /// <summary>
+        /// Устройство всё ещё подключено
+        /// </summary>
+        bool IsPresent();
+
+        ILoaderTransport Open();
+    }
+
+    /// <summary>
+    /// Загрузчик на шине USB, через HidSharp
+    /// </summary>
+    public class HidLoaderDevice : ILoaderDevice
+    {
+        readonly HidDevice dev;
+
+        public HidLoaderDevice(HidDevice dev)
+        {
+            if (dev == null) throw new ArgumentNullException("dev");
+            this.dev = dev;
+        }
+
+        public HidDevice Device
+        {
+            get { return dev; }
+        }
+
+        public string DevicePath
+        {
+            get { return dev.DevicePath; }
+        }
+
+        public string SerialNumber
+        {
+            get { return ReadSerialNumber(dev); }
+        }
+
+        internal static string ReadSerialNumber(HidDevice dev)
+        {
+            try
+            {
+                // Empty serial would share one cache entry between boards
+                string serial = dev.SerialNumber;
+                return string.IsNullOrEmpty(serial) ? null : serial;
+            }
+            catch
+            {
+                // Loader without serial number
+                return null;
+            }
+        }
+
+        public bool IsPresent()
+        {
+            HidDeviceLoader ldr = new HidDeviceLoader();
+            foreach (HidDevice device in ldr.GetDevices(dev.VendorID, dev.ProductID, null, null))
+            {
+                if (device.DevicePath == dev.DevicePath) return true;
+            }
+            return false;
+        }
+
+        public ILoaderTransport Open()
+        {
+            return new HidTransport(dev.Open());
+        }
+
+        class HidTransport : ILoaderTransport
+        {
+            readonly HidStream stream;
+
+            public HidTransport(HidStream stream)
+            {
+                this.stream = stream;
+            }
+
+            public void SetFeature(byte[] report)
+            {
+                stream.SetFeature(report);
+            }
+
+            public void GetFeature(byte[] report)
+            {
+                stream.GetFeature(report);
+            }
+
+            public void Dispose()
+            {
+                stream.Dispose();
+            }
+        }
+    }
+}
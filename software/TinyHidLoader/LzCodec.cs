@@ -0,0 +1,149 @@
+﻿using System;
+using System.Collections.Generic;
+using System.Text;
+
+namespace DeliSu.TinyHidLoader
+{
+    /// <summary>
+    /// Побайтовый LZ77, который умеет распаковывать reloader
+    /// </summary>
+    /// <remarks>
+    /// Токен меньше 0x80 - за ним следуют (токен + 1) байт как есть.
+    /// Токен 0x80 и больше - копия (токен - 0x80 + MIN_MATCH) байт,
+    /// начиная с расстояния назад в распакованных данных (16 бит, младший байт первым).
+    /// </remarks>
+    public static class LzCodec
+    {
+        public const int MIN_MATCH = 3;
+        public const int MAX_MATCH = 0x7f + MIN_MATCH;
+        public const int MAX_LITERALS = 0x80;
+        public const int MAX_DISTANCE = 0xffff;
+
+        /// <summary>
+        /// Упаковывает данные
+        /// </summary>
+        /// <param name="data">Данные</param>
+        /// <param name="offset">Смещение данных</param>
+        /// <param name="count">Размер данных</param>
+        /// <returns>Упакованные данные</returns>
+        public static byte[] Pack(byte[] data, int offset, int count)
+        {
+            List<byte> result = new List<byte>(count);
+            // Позиции по первым трём байтам, для быстрого поиска совпадений
+            Dictionary<int, List<int>> heads = new Dictionary<int, List<int>>();
+            int end = offset + count;
+            int literals = offset;
+            int pos = offset;
+            while (pos < end)
+            {
+                int bestLength = 0;
+                int bestDistance = 0;
+                List<int> candidates;
+                if (pos + MIN_MATCH <= end && heads.TryGetValue(Head(data, pos), out candidates))
+                {
+                    for (int i = candidates.Count - 1; i >= 0; i--)
+                    {
+                        int from = candidates[i];
+                        if (pos - from > MAX_DISTANCE) break;
+                        int length = 0;
+                        // Copy may overlap current position, as unpacker copies byte by byte
+                        while (length < MAX_MATCH && pos + length < end && data[from + length] == data[pos + length])
+                            length++;
+                        if (length > bestLength)
+                        {
+                            bestLength = length;
+                            bestDistance = pos - from;
+                            if (length == MAX_MATCH) break;
+                        }
+                    }
+                }
+
+                if (bestLength >= MIN_MATCH)
+                {
+                    FlushLiterals(result, data, literals, pos);
+                    result.Add((byte)(0x80 + bestLength - MIN_MATCH));
+                    result.Add((byte)(bestDistance & 0xff));
+                    result.Add((byte)((bestDistance >> 8) & 0xff));
+                    for (int i = 0; i < bestLength; i++) AddHead(heads, data, pos + i, end);
+                    pos += bestLength;
+                    literals = pos;
+                }
+                else
+                {
+                    AddHead(heads, data, pos, end);
+                    pos++;
+                }
+            }
+            FlushLiterals(result, data, literals, end);
+            return result.ToArray();
+        }
+
+        /// <summary>
+        /// Распаковывает данные
+        /// </summary>
+        /// <param name="packed">Упакованные данные</param>
+        /// <param name="size">Размер распакованных данных</param>
+        /// <returns>Распакованные данные</returns>
+        public static byte[] Unpack(byte[] packed, int size)
+        {
+            byte[] result = new byte[size];
+            int src = 0;
+            int dst = 0;
+            while (dst < size)
+            {
+                if (src >= packed.Length) throw new FormatException("packed data is truncated");
+                int token = packed[src++];
+                if (token < 0x80)
+                {
+                    int count = token + 1;
+                    if (src + count > packed.Length || dst + count > size)
+                        throw new FormatException("packed data is corrupted");
+                    Array.Copy(packed, src, result, dst, count);
+                    src += count;
+                    dst += count;
+                }
+                else
+                {
+                    if (src + 2 > packed.Length) throw new FormatException("packed data is truncated");
+                    int count = token - 0x80 + MIN_MATCH;
+                    int distance = packed[src] | (packed[src + 1] << 8);
+                    src += 2;
+                    if (distance == 0 || distance > dst || dst + count > size)
+                        throw new FormatException("packed data is corrupted");
+                    for (int i = 0; i < count; i++, dst++)
+                        result[dst] = result[dst - distance];
+                }
+            }
+            return result;
+        }
+
+        static int Head(byte[] data, int pos)
+        {
+            return data[pos] | (data[pos + 1] << 8) | (data[pos + 2] << 16);
+        }
+
+        static void AddHead(Dictionary<int, List<int>> heads, byte[] data, int pos, int end)
+        {
+            if (pos + MIN_MATCH > end) return;
+            int head = Head(data, pos);
+            List<int> list;
+            if (!heads.TryGetValue(head, out list))
+            {
+                list = new List<int>();
+                heads.Add(head, list);
+            }
+            list.Add(pos);
+        }
+
+        static void FlushLiterals(List<byte> result, byte[] data, int from, int to)
+        {
+            while (from < to)
+            {
+                int count = Math.Min(to - from, MAX_LITERALS);
+                result.Add((byte)(count - 1));
+                for (int i = 0; i < count; i++) result.Add(data[from + i]);
+                from += count;
+            }
+        }
+    }
+}
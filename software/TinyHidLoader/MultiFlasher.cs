@@ -0,0 +1,180 @@
+﻿using System;
+using System.Collections.Generic;
+using System.Diagnostics;
+using System.Text;
+using System.Threading;
+
+namespace DeliSu.TinyHidLoader
+{
+    /// <summary>
+    /// Результат прошивки одного устройства
+    /// </summary>
+    public class FlashResult
+    {
+        public string DevicePath { get; private set; }
+
+        /// <summary>
+        /// Ошибка, или null, если прошивка успешна
+        /// </summary>
+        public Exception Error { get; internal set; }
+
+        public TimeSpan Elapsed { get; internal set; }
+
+        public bool Success
+        {
+            get { return Error == null; }
+        }
+
+        public FlashResult(string devicePath)
+        {
+            DevicePath = devicePath;
+        }
+
+        public override string ToString()
+        {
+            if (Success) return string.Format("{0}: done in {1} ms", DevicePath, (int)Elapsed.TotalMilliseconds);
+            return string.Format("{0}: {1}", DevicePath, Error.Message);
+        }
+    }
+
+    /// <summary>
+    /// Общий ход прошивки нескольких устройств
+    /// </summary>
+    public class MultiFlashProgressEventArgs : EventArgs
+    {
+        /// <summary>
+        /// Устройство, по которому пришло изменение
+        /// </summary>
+        public string DevicePath { get; private set; }
+
+        /// <summary>
+        /// Записано байт по всем устройствам
+        /// </summary>
+        public long Done { get; private set; }
+
+        /// <summary>
+        /// Всего байт по всем устройствам
+        /// </summary>
+        public long Total { get; private set; }
+
+        public MultiFlashProgressEventArgs(string devicePath, long done, long total)
+        {
+            DevicePath = devicePath;
+            Done = done;
+            Total = total;
+        }
+    }
+
+    /// <summary>
+    /// Прошивка нескольких загрузчиков одновременно
+    /// </summary>
+    /// <remarks>
+    /// Каждое устройство прошивается асинхронно через свою сессию, паузы между страницами
+    /// не занимают потоки, так что десятки устройств обслуживает несколько потоков пула.
+    /// Ошибка одного устройства не прерывает остальные.
+    /// </remarks>
+    public class MultiFlasher
+    {
+        readonly List<Loader> loaders;
+        int[] done;
+        long total;
+
+        /// <summary>
+        /// Вызывается из пула потоков после записи каждой страницы
+        /// </summary>
+        public event EventHandler<MultiFlashProgressEventArgs> Progress;
+
+        /// <summary>
+        /// Запрос отмены прошивки всех устройств, или null
+        /// </summary>
+        public LoaderCancellation Cancellation { get; set; }
+
+        public MultiFlasher(List<Loader> loaders)
+        {
+            this.loaders = loaders;
+        }
+
+        public int Count
+        {
+            get { return loaders.Count; }
+        }
+
+        /// <summary>
+        /// Прошивает все устройства и ждёт завершения
+        /// </summary>
+        /// <param name="programm">Образ прошивки</param>
+        /// <param name="offset">Смещение в массиве образа</param>
+        /// <param name="leave">Выйти из загрузчика после записи</param>
+        /// <returns>Результаты в порядке устройств</returns>
+        public List<FlashResult> Flash(byte[] programm, int offset, bool leave)
+        {
+            return Flash(FlashPlan.Create(programm, offset), leave);
+        }
+
+        /// <summary>
+        /// Прошивает все устройства одним планом и ждёт завершения
+        /// </summary>
+        /// <param name="plan">План записи</param>
+        /// <param name="leave">Выйти из загрузчика после записи</param>
+        /// <returns>Результаты в порядке устройств</returns>
+        public List<FlashResult> Flash(FlashPlan plan, bool leave)
+        {
+            done = new int[loaders.Count];
+            total = (long)plan.Size * loaders.Count;
+            List<FlashResult> results = new List<FlashResult>();
+            int pending = loaders.Count;
+            using (ManualResetEvent finished = new ManualResetEvent(pending == 0))
+            {
+                for (int i = 0; i < loaders.Count; i++)
+                {
+                    Loader ldr = loaders[i];
+                    FlashResult result = new FlashResult(ldr.DevicePath);
+                    int index = i;
+                    results.Add(result);
+                    Stopwatch watch = Stopwatch.StartNew();
+                    LoaderSession session = null;
+                    try
+                    {
+                        session = ldr.OpenSession();
+                        session.Progress += delegate(object sender, LoaderProgressEventArgs e) { OnProgress(ldr, index, e.Done); };
+                        session.BeginWriteFlash(plan, Cancellation, delegate(IAsyncResult ar)
+                        {
+                            try
+                            {
+                                session.EndWriteFlash(ar);
+                                if (leave) session.LeaveBootloader();
+                            }
+                            catch (Exception e)
+                            {
+                                result.Error = e;
+                            }
+                            session.Dispose();
+                            result.Elapsed = watch.Elapsed;
+                            if (Interlocked.Decrement(ref pending) == 0) finished.Set();
+                        }, null);
+                    }
+                    catch (Exception e)
+                    {
+                        if (session != null) session.Dispose();
+                        result.Error = e;
+                        if (Interlocked.Decrement(ref pending) == 0) finished.Set();
+                    }
+                }
+                finished.WaitOne();
+            }
+            return results;
+        }
+
+        private void OnProgress(Loader ldr, int index, int deviceDone)
+        {
+            long sum = 0;
+            lock (done)
+            {
+                done[index] = deviceDone;
+                foreach (int d in done) sum += d;
+            }
+            EventHandler<MultiFlashProgressEventArgs> handler = Progress;
+            if (handler != null) handler(this, new MultiFlashProgressEventArgs(ldr.DevicePath, sum, total));
+        }
+    }
+}
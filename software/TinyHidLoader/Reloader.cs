@@ -0,0 +1,199 @@
+﻿using System;
+using System.Collections.Generic;
+using System.Text;
+
+namespace DeliSu.TinyHidLoader
+{
+    /// <summary>
+    /// Обновление загрузчика через reloader
+    /// </summary>
+    /// <remarks>
+    /// Загрузчик не может перезаписать сам себя, а AVR не исполняет код из RAM,
+    /// поэтому новый загрузчик копирует на место reloader, записанный как обычное приложение.
+    /// Образ: reloader с начала FLASH, на странице INFO - адрес, crc16, размер и кодек нового загрузчика,
+    /// со следующей страницы - сам новый загрузчик, возможно упакованный.
+    /// Адрес INFO и поддерживаемые кодеки reloader сообщает описателем по адресу DESCRIPTOR,
+    /// reloader без описателя принимает только неупакованные данные на странице 0x0280.
+    /// </remarks>
+    public class Reloader
+    {
+        public const int DEFAULT_INFO = 0x0280;
+        public const int DESCRIPTOR = 0x0002;
+        // reloader без описателя заканчивается недостижимыми ret и _exit (cli; rjmp .) на странице INFO,
+        // которые всегда затирались полями INFO
+        const int LEGACY_TAIL = 6;
+        // Смещения полей на странице INFO
+        const int INFO_OFFSET = 0;
+        const int INFO_CRC = 2;
+        const int INFO_SIZE = 4;
+        const int INFO_PACKED_SIZE = 6;
+        const int INFO_CODEC = 8;
+        public const byte CODEC_RAW = 0xff;
+        public const byte CODEC_LZ = 0x01;
+        // Время на проверку и копирование нового загрузчика, в миллисекундах
+        const int REMOVAL_TIMEOUT = 10000;
+
+        HexFile reloader;
+
+        /// <summary>
+        /// Адрес страницы INFO
+        /// </summary>
+        public int Info { get; private set; }
+
+        /// <summary>
+        /// Адрес данных нового загрузчика
+        /// </summary>
+        public int BootloaderData { get { return Info + Loader.PAGESIZE; } }
+
+        /// <summary>
+        /// Reloader сообщает свою раскладку описателем; старый reloader.hex без него
+        /// </summary>
+        public bool HasDescriptor { get; private set; }
+
+        /// <summary>
+        /// Reloader умеет распаковывать CODEC_LZ
+        /// </summary>
+        public bool CanUnpack { get; private set; }
+
+        /// <summary>
+        /// Кодек данных последнего построенного образа
+        /// </summary>
+        public byte Codec { get; private set; }
+
+        /// <summary>
+        /// Размер данных нового загрузчика в последнем построенном образе
+        /// </summary>
+        public int StoredSize { get; private set; }
+
+        public Reloader(HexFile reloader)
+        {
+            this.reloader = reloader;
+            int info, codecs;
+            int tail = 0;
+            if (TryReadWord(reloader, DESCRIPTOR, out info) && TryReadWord(reloader, DESCRIPTOR + 2, out codecs))
+            {
+                if (info % Loader.PAGESIZE != 0 || info >= Loader.LOADERSTART)
+                    throw new FormatException("reloader descriptor is corrupted");
+                Info = info;
+                HasDescriptor = true;
+                CanUnpack = (codecs & (1 << CODEC_LZ)) != 0;
+            }
+            else
+            {
+                Info = DEFAULT_INFO;
+                tail = LEGACY_TAIL;
+            }
+            if (reloader.End > Info + tail) throw new FormatException("reloader too big");
+        }
+
+        static bool TryReadWord(HexFile hex, long address, out int value)
+        {
+            value = 0;
+            foreach (HexFile.HexChunk c in hex.Chunks)
+            {
+                if (address >= c.Offset && address + 2 <= c.Offset + c.Data.Length)
+                {
+                    value = c.Data[address - c.Offset] | (c.Data[address - c.Offset + 1] << 8);
+                    return true;
+                }
+            }
+            return false;
+        }
+
+        /// <summary>
+        /// Строит образ для записи загрузчиком: reloader вместе с новым загрузчиком
+        /// </summary>
+        /// <param name="bootloader">Новый загрузчик</param>
+        /// <returns>Образ прошивки</returns>
+        public byte[] BuildImage(HexFile bootloader)
+        {
+            // create image for writing
+            byte[] programm = new byte[Loader.LOADERSTART];
+            // fill image with 0xff
+            for (int i = 0; i < programm.Length; i++) programm[i] = 0xff;
+            // write jump to reloader
+            programm[0] = 0x20;
+            programm[1] = 0xc0;
+            // write reloader
+            reloader.Fill(programm);
+
+            int address = (int)bootloader.Offset;
+            int size = Loader.FLASHSIZE - address;
+            if (address % Loader.PAGESIZE != 0)
+                throw new FormatException("bootloader address is not aligned by page");
+            // Stored data must end below application vectors page, which reloader erases first
+            int limit = Math.Min(Loader.LOADERSTART, address - Loader.PAGESIZE);
+
+            FlashImage image = new FlashImage(size);
+            image.Load(bootloader, -address);
+            byte[] raw = image.Data;
+
+            byte[] stored = raw;
+            Codec = CODEC_RAW;
+            if (CanUnpack)
+            {
+                byte[] packed = LzCodec.Pack(raw, 0, raw.Length);
+                if (packed.Length < raw.Length)
+                {
+                    // Never write data, which reloader would unpack to something else
+                    byte[] check = LzCodec.Unpack(packed, raw.Length);
+                    for (int i = 0; i < raw.Length; i++)
+                        if (check[i] != raw[i]) throw new InvalidOperationException("packer failed");
+                    stored = packed;
+                    Codec = CODEC_LZ;
+                }
+            }
+            if (BootloaderData + stored.Length > limit)
+                throw new FormatException("bootloader is too big to fit");
+            StoredSize = stored.Length;
+
+            Array.Copy(stored, 0, programm, BootloaderData, stored.Length);
+            WriteWord(programm, Info + INFO_OFFSET, address);
+            WriteWord(programm, Info + INFO_CRC, Loader.Crc16(stored, 0, stored.Length));
+            if (Codec != CODEC_RAW)
+            {
+                WriteWord(programm, Info + INFO_SIZE, size);
+                WriteWord(programm, Info + INFO_PACKED_SIZE, stored.Length);
+                programm[Info + INFO_CODEC] = Codec;
+            }
+            return programm;
+        }
+
+        static void WriteWord(byte[] buffer, int offset, int value)
+        {
+            buffer[offset] = (byte)(value & 0xff);
+            buffer[offset + 1] = (byte)((value >> 8) & 0xff);
+        }
+
+        /// <summary>
+        /// Обновляет загрузчик
+        /// </summary>
+        /// <remarks>
+        /// Пишет reloader с новым загрузчиком, выходит в него, ждёт отключения и
+        /// появления нового загрузчика и стирает reloader.
+        /// Новый загрузчик ищется по серийному номеру старого, так что с серийным номером
+        /// он должен собираться с тем же CAN_SERIAL_NUMBER.
+        /// </remarks>
+        /// <param name="ldr">Текущий загрузчик</param>
+        /// <param name="bootloader">Новый загрузчик</param>
+        /// <param name="timeout">Время ожидания нового загрузчика, в секундах</param>
+        /// <returns>Новый загрузчик</returns>
+        public Loader Update(Loader ldr, HexFile bootloader, int timeout)
+        {
+            byte[] programm = BuildImage(bootloader);
+            // Same chip, same serial: don't pick up another board on the host
+            string serial = ldr.SerialNumber;
+            using (LoaderSession session = ldr.OpenSession())
+            {
+                session.QueueWrite(programm, 0).QueueLeave().Execute();
+            }
+            // Reloader works without USB, old device disappears only when
+            // new loader reconnects. Until that moment old device is still listed.
+            // If it never disappears, the reloader did not run and the old loader is still there.
+            if (!ldr.WaitForRemoval(REMOVAL_TIMEOUT)) throw new Exception("Loader was not updated: reloader did not start");
+            ldr = Loader.TryGetLoader(timeout, serial);
+            ldr.EraseFlash();
+            return ldr;
+        }
+    }
+}
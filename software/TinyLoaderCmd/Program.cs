@@ -2,6 +2,7 @@
 using System;
 using System.Collections.Generic;
 using System.IO;
+using System.Net;
 using System.Reflection;
 using System.Text;
 using System.Threading;
@@ -10,17 +11,86 @@ namespace DeliSu.TinyLoaderCmd
 {
     class Program
     {
-        const int RELOADER_INFO = 0x0280;
-        const int RELOADER_INFO_OFFSET = RELOADER_INFO;
-        const int RELOADER_INFO_CRC = RELOADER_INFO + 2;
-        const int RELOADER_BOOTLOADER_DATA = RELOADER_INFO + Loader.PAGESIZE;
+        // Records every report, pause and retry when "--trace" is given
+        static LoaderTrace trace;
 
         static void Main(string[] args)
         {
+            // Optional "-s SERIAL" selects loader by serial number, "--trace FILE.JSON" traces transfers
+            string serial = null;
+            string traceFile = null;
+            while (args.Length >= 2 && (args[0] == "-s" || args[0] == "--trace"))
+            {
+                if (args[0] == "-s")
+                    serial = args[1];
+                else
+                    traceFile = args[1];
+                string[] rest = new string[args.Length - 2];
+                Array.Copy(args, 2, rest, 0, rest.Length);
+                args = rest;
+            }
+
+            if (traceFile != null) trace = new LoaderTrace();
+            try
+            {
+                Run(args, serial);
+            }
+            finally
+            {
+                if (trace != null)
+                {
+                    Console.WriteLine(trace.Summary());
+                    trace.WriteJson(traceFile);
+                    Console.WriteLine("Trace saved to {0}", traceFile);
+                }
+            }
+        }
+
+        static void Run(string[] args, string serial)
+        {
+            if (args.Length == 3 && args[0] == "plan" && File.Exists(args[1]))
+            {
+                try
+                {
+                    FlashImage image = LoadImage(args[1]);
+                    FlashPlan.Create(image).Save(args[2]);
+                    Console.WriteLine("Plan saved to {0}", args[2]);
+                }
+                catch (Exception e)
+                {
+                    Console.WriteLine(e.Message);
+                }
+                return;
+            }
+            if (args.Length == 2 && args[0] == "all" && File.Exists(args[1]))
+            {
+                FlashAll(args[1], serial);
+                return;
+            }
+            int port = LoaderDaemon.DEFAULT_PORT;
+            if ((args.Length == 1 || args.Length == 2 && int.TryParse(args[1], out port) && port > 0 && port <= IPEndPoint.MaxPort) &&
+                args[0] == "daemon")
+            {
+                RunDaemon(port);
+                return;
+            }
+            if ((args.Length == 2 || args.Length == 3 && args[2] == "leave") && args[0] == "watch" && File.Exists(args[1]))
+            {
+                Watch(args[1], serial, args.Length == 3);
+                return;
+            }
+            if (args.Length == 1 && args[0] == "list")
+            {
+                foreach (Loader l in Loader.GetLoaders(serial))
+                    Console.WriteLine("{0} {1}", l.SerialNumber ?? "-", l.DevicePath);
+                return;
+            }
+
             Loader ldr;
             try
             {
-                ldr = new Loader();
+                ldr = new Loader(serial);
+                ldr.Trace = trace;
             }
             catch (Exception e)
             {
@@ -32,27 +102,67 @@ namespace DeliSu.TinyLoaderCmd
                 args.Length == 2 && args[1] == "notleave" && File.Exists(args[0]))
             {
                 // Write
-                HexFile file = new HexFile(args[0]);
-                byte[] programm = new byte[Loader.LOADERSTART];
-                for (int i = 0; i < programm.Length; i++) programm[i] = 0xff;
-                file.Fill(programm);
+                bool resumable = ldr.SerialNumber != null && !IsPlanFile(args[0]);
                 try
                 {
                     DateTime now = DateTime.Now;
-                    ldr.WriteFlash(programm, 0);
+                    using (LoaderSession session = ldr.OpenSession())
+                    {
+                        if (resumable)
+                        {
+                            // Full write through the page cache, which journals an interrupted write for resume
+                            DeltaCache cache = new DeltaCache();
+                            cache.Invalidate(ldr.SerialNumber);
+                            FlashImage image = LoadImage(args[0]);
+                            string serialNumber = ldr.SerialNumber;
+                            session.Queue(delegate { session.WriteFlash(image, cache, serialNumber); });
+                        }
+                        else
+                        {
+                            session.QueueWrite(LoadPlan(args[0]));
+                        }
+                        if (args.Length != 2 || args[1] != "notleave")
+                            session.QueueLeave();
+                        session.Execute();
+                    }
                     int ellapsed = (int)(DateTime.Now - now).TotalMilliseconds;
                     Console.WriteLine("Done in {0} ms", ellapsed);
-                    if (args.Length != 2 || args[1] != "notleave")
-                        ldr.LeaveBootloader();
+                    Console.WriteLine("Pacing: {0}", ldr.Pacer);
                     Console.WriteLine("Success");
                 }
                 catch (Exception e)
                 {
                     Console.WriteLine(e.Message);
+                    if (resumable)
+                        Console.WriteLine("Run 'resume {0}' to continue without erasing again", args[0]);
                     return;
                 }
                 return;
             }
+            else if (args.Length == 2 && (args[0] == "delta" || args[0] == "resume") && File.Exists(args[1]))
+            {
+                FlashImage image = LoadImage(args[1]);
+                try
+                {
+                    DateTime now = DateTime.Now;
+                    int pages;
+                    using (LoaderSession session = ldr.OpenSession())
+                    {
+                        pages = session.WriteFlash(image, new DeltaCache(), ldr.SerialNumber);
+                        session.LeaveBootloader();
+                    }
+                    int ellapsed = (int)(DateTime.Now - now).TotalMilliseconds;
+                    Console.WriteLine("Done in {0} ms, {1} pages sent", ellapsed, pages);
+                    Console.WriteLine("Success");
+                }
+                catch (Exception e)
+                {
+                    Console.WriteLine(e.Message);
+                    if (ldr.SerialNumber != null)
+                        Console.WriteLine("Run 'resume {0}' to continue without erasing again", args[1]);
+                }
+                return;
+            }
             else if (args.Length == 2 && args[0] == "reload" && File.Exists(args[1]))
             {
                 string exe = new Uri(Assembly.GetExecutingAssembly().CodeBase).LocalPath;
@@ -62,50 +172,19 @@ namespace DeliSu.TinyLoaderCmd
                     Console.WriteLine("reloader.hex not exists");
                     return;
                 }
-                // create image for writing
-                byte[] programm = new byte[Loader.LOADERSTART];
-                // fill image with 0xff
-                for (int i = 0; i < programm.Length; i++) programm[i] = 0xff;
-                // write jump to reloader
-                programm[0] = 0x20;
-                programm[1] = 0xc0;
-                HexFile rel = new HexFile(reloader);
-                // write reloader
-                rel.Fill(programm);
-
-                if (rel.End > RELOADER_INFO)
-                {
-                    Console.WriteLine("reloader too big");
-                }
-
-                HexFile hf = new HexFile(args[1]);
-                long address = hf.Offset;
-                long size = Loader.FLASHSIZE - address;
-                if (size + RELOADER_BOOTLOADER_DATA > Loader.LOADERSTART)
-                {
-                    Console.WriteLine("bootloader is too big to fit");
-                    return;
-                }
-                hf.Fill(programm, RELOADER_BOOTLOADER_DATA - address);
-                programm[RELOADER_INFO_OFFSET] = (byte)(address & 0xff);
-                programm[RELOADER_INFO_OFFSET + 1] = (byte)((address >> 8) & 0xff);
-                ushort crc = Loader.Crc16(programm, RELOADER_BOOTLOADER_DATA, (int)size);
-                programm[RELOADER_INFO_CRC] = (byte)(crc & 0xff);
-                programm[RELOADER_INFO_CRC + 1] = (byte)((crc >> 8) & 0xff);
-                HexFile ot = new HexFile();
-                ot.Chunks.Add(new HexFile.HexChunk(0, programm));
                 try
                 {
-                    Console.WriteLine("Writing new bootloader");
+                    Reloader rel = new Reloader(new HexFile(reloader));
+                    if (!rel.HasDescriptor)
+                        Console.WriteLine("reloader.hex has no layout descriptor, bootloader is sent unpacked; rebuild firmware/reloader for packed updates");
+                    HexFile hf = OpenProgram(args[1]);
+                    Console.WriteLine("Updating bootloader");
                     DateTime now = DateTime.Now;
-                    ldr.WriteFlash(programm, 0);
+                    ldr = rel.Update(ldr, hf, 40);
+                    if (rel.Codec != Reloader.CODEC_RAW)
+                        Console.WriteLine("Bootloader packed to {0} bytes", rel.StoredSize);
                     int ellapsed = (int)(DateTime.Now - now).TotalMilliseconds;
-                    Console.WriteLine("Done in {0} ms, begin update", ellapsed);
-                    ldr.LeaveBootloader();
-                    Thread.Sleep(5000);
-                    ldr = Loader.TryGetLoader(40);
-                    Console.WriteLine("Erasing empty space");
-                    ldr.EraseFlash();
+                    Console.WriteLine("Done in {0} ms", ellapsed);
                     Console.WriteLine("Success");
                 }
                 catch (Exception e)
@@ -143,11 +222,214 @@ namespace DeliSu.TinyLoaderCmd
                 ldr.EraseEeprom();
                 return;
             }
+            else if (args.Length == 1 && args[0] == "status")
+            {
+                LoaderStatus status = ldr.ReadStatus();
+                if (status == null)
+                    Console.WriteLine("loader does not report status");
+                else
+                    Console.WriteLine(status);
+                return;
+            }
             Console.WriteLine("USE: TinyHidLoader.exe FILE.HEX - to write flash and exit to application");
             Console.WriteLine("USE: TinyHidLoader.exe FILE.HEX noleave - to write flash");
             Console.WriteLine("USE: TinyHidLoader.exe read FILE.HEX - to read flash");
             Console.WriteLine("USE: TinyHidLoader.exe erase flash - to erase flash");
             Console.WriteLine("USE: TinyHidLoader.exe erase eeprom - to erase eeprom");
+            Console.WriteLine("USE: TinyHidLoader.exe status - to show loader status and enumeration time");
+            Console.WriteLine("USE: TinyHidLoader.exe all FILE.HEX - to write flash of all connected loaders and exit to application");
+            Console.WriteLine("USE: TinyHidLoader.exe delta FILE.HEX - to write only pages changed since last write and exit to application");
+            Console.WriteLine("USE: TinyHidLoader.exe resume FILE.HEX - to finish an interrupted write of a loader with serial number, without erasing again");
+            Console.WriteLine("USE: TinyHidLoader.exe list - to list connected loaders with serial numbers");
+            Console.WriteLine("USE: TinyHidLoader.exe plan FILE.HEX FILE.PLAN - to prepare signed reports once; FILE.PLAN can replace FILE.HEX in write and all");
+            Console.WriteLine("USE: TinyHidLoader.exe watch FILE.HEX [leave] - to write changed pages each time FILE.HEX is rebuilt");
+            Console.WriteLine("USE: TinyHidLoader.exe daemon [PORT] - to serve write/read/erase jobs for all loaders on 127.0.0.1; read saves only inside the current directory");
+            Console.WriteLine("USE: FILE.HEX can also be an avr-gcc ELF file (main.bin)");
+            Console.WriteLine("USE: TinyHidLoader.exe -s SERIAL ... - to select loader by serial number");
+            Console.WriteLine("USE: TinyHidLoader.exe --trace FILE.JSON ... - to print per-phase latency histograms and save every transfer to FILE.JSON");
+        }
+
+        // Quiet time after the last change before the rebuilt file is read
+        const int WATCH_SETTLE_TIME = 200;
+        // How long to wait for the loader after each rebuild, in seconds
+        const int WATCH_LOADER_TIMEOUT = 600;
+
+        /// <summary>
+        /// Writes the image on start and after every rebuild, sending only pages changed since the last write
+        /// </summary>
+        static void Watch(string filename, string serial, bool leave)
+        {
+            string path = Path.GetFullPath(filename);
+            // Loaders without serial number are tracked by device path, in memory only while watching
+            DeltaCache runCache = new DeltaCache(null);
+            DeltaCache serialCache = new DeltaCache();
+            ushort[] flashed = null;
+
+            using (AutoResetEvent changed = new AutoResetEvent(true))
+            using (FileSystemWatcher watcher = new FileSystemWatcher(Path.GetDirectoryName(path), Path.GetFileName(path)))
+            {
+                watcher.NotifyFilter = NotifyFilters.LastWrite | NotifyFilters.Size | NotifyFilters.FileName;
+                watcher.Changed += delegate { changed.Set(); };
+                watcher.Created += delegate { changed.Set(); };
+                watcher.Renamed += delegate { changed.Set(); };
+                watcher.EnableRaisingEvents = true;
+                Console.WriteLine("Watching {0}, Ctrl+C to stop", path);
+
+                while (true)
+                {
+                    changed.WaitOne();
+                    // Compilers write the file in several steps, read it once it stays quiet
+                    while (changed.WaitOne(WATCH_SETTLE_TIME, false)) { }
+
+                    FlashImage image;
+                    try
+                    {
+                        image = LoadImage(path);
+                    }
+                    catch (Exception e)
+                    {
+                        Console.WriteLine("Can't read {0}: {1}", filename, e.Message);
+                        continue;
+                    }
+                    ushort[] crcs = image.PageCrcs();
+                    if (flashed != null && SameCrcs(crcs, flashed))
+                    {
+                        Console.WriteLine("Image not changed");
+                        continue;
+                    }
+
+                    try
+                    {
+                        Loader ldr;
+                        try
+                        {
+                            ldr = new Loader(serial);
+                        }
+                        catch (Exception)
+                        {
+                            Console.WriteLine("Waiting for loader");
+                            ldr = Loader.TryGetLoader(WATCH_LOADER_TIMEOUT, serial);
+                        }
+                        ldr.Trace = trace;
+                        DateTime now = DateTime.Now;
+                        int pages;
+                        using (LoaderSession session = ldr.OpenSession())
+                        {
+                            if (ldr.SerialNumber != null)
+                                pages = session.WriteFlash(image, serialCache, ldr.SerialNumber);
+                            else
+                                pages = session.WriteFlash(image, runCache, ldr.DevicePath);
+                            if (leave) session.LeaveBootloader();
+                        }
+                        flashed = crcs;
+                        int ellapsed = (int)(DateTime.Now - now).TotalMilliseconds;
+                        Console.WriteLine("{0} Done in {1} ms, {2} pages sent", DateTime.Now.ToString("HH:mm:ss"), ellapsed, pages);
+                    }
+                    catch (Exception e)
+                    {
+                        Console.WriteLine(e.Message);
+                    }
+                }
+            }
+        }
+
+        static bool SameCrcs(ushort[] x, ushort[] y)
+        {
+            if (x.Length != y.Length) return false;
+            for (int i = 0; i < x.Length; i++)
+                if (x[i] != y[i]) return false;
+            return true;
+        }
+
+        static void RunDaemon(int port)
+        {
+            LoaderDaemon daemon = new LoaderDaemon(port);
+            daemon.JobCompleted += delegate(object sender, LoaderDaemonEventArgs e)
+            {
+                Console.WriteLine("{0} {1}: {2}", DateTime.Now.ToString("HH:mm:ss"), e.Command, e.Result);
+            };
+            daemon.Start();
+            Console.WriteLine("Listening on {0}, saving reads to {1}", daemon.LocalEndpoint, daemon.OutputDirectory);
+            // Runs until the process is terminated
+            Thread.Sleep(Timeout.Infinite);
+        }
+
+        /// <summary>
+        /// Reads flash contents from Intel HEX or straight from avr-gcc ELF
+        /// </summary>
+        static HexFile OpenProgram(string filename)
+        {
+            if (!ElfFile.IsElf(filename)) return new HexFile(filename);
+            ElfFile elf = new ElfFile(filename);
+            if (elf.Eeprom.Chunks.Count > 0)
+                Console.WriteLine("Warning: {0} bytes of .eeprom data are ignored, loader can't write EEPROM", elf.Eeprom.Length);
+            return elf.Flash;
+        }
+
+        static FlashImage LoadImage(string filename)
+        {
+            HexFile file = OpenProgram(filename);
+            if (file.End > Loader.LOADERSTART)
+                Console.WriteLine("Warning: data above 0x{0:X4} overlaps bootloader and is ignored", Loader.LOADERSTART);
+            FlashImage image = FlashImage.FromHex(file, Loader.LOADERSTART);
+            Console.WriteLine("Image: {0} of {1} pages used", image.UsedPageCount, image.PageCount);
+            return image;
+        }
+
+        /// <summary>
+        /// Reads prebuilt plan by .plan extension, otherwise builds it from HEX file
+        /// </summary>
+        static FlashPlan LoadPlan(string filename)
+        {
+            if (IsPlanFile(filename))
+                return FlashPlan.Load(filename);
+            return FlashPlan.Create(LoadImage(filename));
+        }
+
+        static bool IsPlanFile(string filename)
+        {
+            return string.Equals(Path.GetExtension(filename), ".plan", StringComparison.OrdinalIgnoreCase);
+        }
+
+        static void FlashAll(string filename, string serial)
+        {
+            List<Loader> loaders = Loader.GetLoaders(serial);
+            if (loaders.Count == 0)
+            {
+                Console.WriteLine("Device not found");
+                return;
+            }
+            FlashPlan plan;
+            try
+            {
+                plan = LoadPlan(filename);
+            }
+            catch (Exception e)
+            {
+                Console.WriteLine(e.Message);
+                return;
+            }
+
+            foreach (Loader l in loaders) l.Trace = trace;
+            Console.WriteLine("Writing {0} devices", loaders.Count);
+            MultiFlasher flasher = new MultiFlasher(loaders);
+            int lastPercent = -1;
+            flasher.Progress += delegate(object sender, MultiFlashProgressEventArgs e)
+            {
+                int percent = (int)(e.Done * 100 / e.Total);
+                if (Interlocked.Exchange(ref lastPercent, percent) / 10 != percent / 10)
+                    Console.WriteLine("{0}%", percent);
+            };
+            DateTime now = DateTime.Now;
+            List<FlashResult> results = flasher.Flash(plan, true);
+            int ellapsed = (int)(DateTime.Now - now).TotalMilliseconds;
+            int failed = 0;
+            foreach (FlashResult result in results)
+            {
+                Console.WriteLine(result);
+                if (!result.Success) failed++;
+            }
+            Console.WriteLine("Done in {0} ms, {1} of {2} failed", ellapsed, failed, results.Count);
         }
     }
 }